@@ -181,3 +181,44 @@ Auth::sendRequest (const std::string & url,
   return ret;
 }
 
+
+std::string
+Auth::sendUpload (const std::string & url,
+                  requestType type,
+                  const std::string & headers,
+                  struct Source & source)
+{
+  // Update the access token if necessary.
+  this->check_access_token();
+
+  // Stream the body from the source.
+  return this->reqObj.sendUpload(url, type, headers, source);
+}
+
+
+size_t
+Auth::sendDownload (const std::string & url,
+                    off_t start,
+                    off_t stop,
+                    const struct iovec * iov,
+                    int iovcnt,
+                    std::string & error)
+{
+  // Update the access token if necessary.
+  this->check_access_token();
+
+  // Download straight into the destination.
+  return this->reqObj.sendDownload(url, start, stop, iov, iovcnt, error);
+}
+
+
+void
+Auth::sendAsync (struct Transfer * t,
+                 long delay)
+{
+  // Update the access token if necessary.
+  this->check_access_token();
+
+  // Queue the request.
+  this->reqObj.sendAsync(t, delay);
+}
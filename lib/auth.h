@@ -72,6 +72,24 @@ class Auth {
                  std::string query = "",      
                  bool secret = false,
                  std::string headers_ = "");
+
+    std::string
+    sendUpload (const std::string & url,
+                requestType type,
+                const std::string & headers_,
+                struct Source & source);
+
+    size_t
+    sendDownload (const std::string & url,
+                  off_t start,
+                  off_t stop,
+                  const struct iovec * iov,
+                  int iovcnt,
+                  std::string & error);
+
+    void
+    sendAsync (struct Transfer * t,
+               long delay = 0);
 };
 
 #endif // AUTH_H__
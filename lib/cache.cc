@@ -39,7 +39,9 @@
 
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include "cache.h"
 #include "log.h"
@@ -48,416 +50,2048 @@
 #include "conf.h"
 #include "json.h"
 #include "exception.h"
+#include "common.h"
+
+
+std::string cache_policy = "tinylfu";
+std::string cache_trace = "";
+unsigned cache_high_watermark = GDFS_CACHE_HIGH_WATERMARK;
+unsigned cache_low_watermark = GDFS_CACHE_LOW_WATERMARK;
+
+
+/*
+ * Function to grow the memory of a block to atleast len bytes.
+ * The memory grows in slab size classes, doubling upto the block size.
+ * Returns the number of bytes added.
+ */
+size_t
+Block::reserve (size_t len)
+{
+
+  char * m = NULL;
+  size_t capacity_ = 0;
+
+  if (len <= this->capacity) {
+    return 0;
+  }
+
+  capacity_ = std::max(len, std::min((size_t) GDFS_CACHE_BLOCK_SIZE, this->capacity * 2));
+  capacity_ = slab.round(capacity_);
+
+  m = slab.alloc(capacity_);
+  assert(m != NULL);
+  if (this->mem != NULL) {
+    memcpy(m, this->mem, this->capacity);
+    slab.free(this->mem, this->capacity);
+  }
+  this->mem = m;
+  std::swap(this->capacity, capacity_);
+
+  return this->capacity - capacity_;
+}
+
+
+// Downloads running, over all the files.
+static unsigned running_fetches = 0;
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * Function to delete all the blocks of a file.
+ * The file lock must be held.
+ */
+size_t
+File::free_blocks (void)
+{
+
+  size_t size_ = this->size;
+  size_t kept = 0;
+
+  for (auto b : this->blocks) {
+    if (b != NULL) {
+      this->set_dirty(b, 0);
+      this->drop_block(b, &kept);
+    }
+  }
+  this->blocks.clear();
+  this->holes.clear();
+
+  // Drop the writes not yet copied into the blocks.
+  this->dirty_bytes -= this->extent_len;
+  this->extent_len = 0;
+  slab.free(this->extent, GDFS_CACHE_BLOCK_SIZE);
+  this->extent = NULL;
+
+  // Reset file size in cache.
+  // The blocks held by the snapshot are freed along with it.
+  this->size = kept;
+  ++this->generation;
+
+  return size_ - kept;
+}
+
+
+/*
+ * Function to delete all the blocks of a file from cache,
+ * along with the copy in the disk cache.
+ * Returns the number of bytes freed.
+ */
+size_t
+File::delete_blocks (void)
+{
+
+  Debug("<-- Entering File delete_blocks() -->");
+
+  size_t size_ = 0;
+
+  pthread_mutex_lock(&lock);
+  size_ = this->free_blocks();
+  this->disk.drop(this->id);
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting File delete_blocks() -->");
+  return size_;
+}
+
+
+/*
+ * Function to note a read or write of len bytes from offset.
+ * Returns false if it only continues the last read or write.
+ */
+bool
+File::touch (off_t offset,
+             size_t len)
+{
+
+  bool counted = false;
+
+  pthread_mutex_lock(&lock);
+  counted = (offset != this->last_end);
+  this->last_end = offset + len;
+  pthread_mutex_unlock(&lock);
+
+  return counted;
+}
+
+
+/*
+ * Function to set the dirty sectors of a block,
+ * keeping the count of dirty bytes in the cache.
+ * The file lock must be held.
+ */
+void
+File::set_dirty (struct Block * b,
+                 uint64_t mask)
+{
+  this->dirty_bytes += __builtin_popcountll(mask) * GDFS_CACHE_SECTOR_SIZE;
+  this->dirty_bytes -= __builtin_popcountll(b->dirty) * GDFS_CACHE_SECTOR_SIZE;
+  b->dirty = mask;
+}
+
+
+/*
+ * Function to evict the blocks of a file from memory.
+ * The clean sectors are moved into the disk cache.
+ * Blocks with sectors not yet saved in Google Drive stay,
+ * as they are the only copy of the data. kept tells whether
+ * any memory is left to the file.
+ * Returns the number of bytes freed.
+ */
+size_t
+File::evict (bool & kept)
+{
+
+  Debug("<-- Entering File evict() -->");
+
+  size_t size_ = 0;
+  uint64_t mask;
+  struct Block * b = NULL;
+
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < this->blocks.size(); ++i) {
+    b = this->blocks[i];
+    if (b == NULL) {
+      continue;
+    }
+
+    mask = b->valid & ~b->dirty;
+    if (mask != 0 && this->disk.enabled()) {
+      this->disk.store(this->id, this->mtime, this->md5, i, mask, b->mem);
+    }
+
+    // The block of the extent stays, with the sectors
+    // the extent covers in part.
+    if (b->dirty == 0 &&
+        (this->extent_len == 0 || i != (size_t) this->extent_offset / GDFS_CACHE_BLOCK_SIZE)) {
+      size_ += this->drop_block(b);
+      this->blocks[i] = NULL;
+    }
+  }
+  while (this->blocks.empty() == false && this->blocks.back() == NULL) {
+    this->blocks.pop_back();
+  }
+
+  if (this->extent != NULL && this->extent_len == 0) {
+    slab.free(this->extent, GDFS_CACHE_BLOCK_SIZE);
+    this->extent = NULL;
+    size_ += GDFS_CACHE_BLOCK_SIZE;
+  }
+  this->size -= size_;
+  kept = (this->size > 0);
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting File evict() -->");
+  return size_;
+}
+
+
+/*
+ * Function to find the block at index, creating it if required,
+ * with memory for atleast its first len bytes.
+ */
+struct Block *
+File::get_block (size_t index,
+                 size_t len,
+                 size_t & added)
+{
+
+  struct Block * b = NULL;
+
+  if (index >= this->blocks.size()) {
+    this->blocks.resize(index + 1, NULL);
+  }
+
+  b = this->blocks[index];
+  if (b == NULL) {
+    b = new Block();
+    assert(b != NULL);
+    this->blocks[index] = b;
+  }
+  b = this->own_block(index, added);
+
+  len = b->reserve(len);
+  this->size += len;
+  added += len;
+
+  return b;
+}
+
+
+/*
+ * Function to get the block at index ready to be changed,
+ * copying it first if the snapshot of an upload holds it.
+ * The file lock must be held.
+ */
+struct Block *
+File::own_block (size_t index,
+                 size_t & added)
+{
+
+  struct Block * b = this->blocks[index];
+  struct Block * copy = NULL;
+
+  if (b->refs == 1) {
+    return b;
+  }
+
+  copy = new Block();
+  assert(copy != NULL);
+  copy->reserve(b->capacity);
+  memcpy(copy->mem, b->mem, b->capacity);
+  copy->valid = b->valid;
+  copy->dirty = b->dirty;
+
+  --b->refs;
+  this->blocks[index] = copy;
+  this->size += copy->capacity;
+  added += copy->capacity;
+
+  return copy;
+}
+
+
+/*
+ * Function to let go of a block, deleting it
+ * unless the snapshot of an upload still holds it.
+ * Returns the number of bytes freed, and adds the bytes
+ * still held by the snapshot to kept when given.
+ * The file lock must be held.
+ */
+size_t
+File::drop_block (struct Block * b,
+                  size_t * kept)
+{
+
+  size_t size_ = b->capacity;
+
+  if (--b->refs > 0) {
+    if (kept != NULL) {
+      *kept += size_;
+    }
+    return 0;
+  }
+  delete b;
+
+  return size_;
+}
+
+
+bool
+File::is_valid (size_t sector) const
+{
+
+  size_t index = sector / GDFS_CACHE_SECTORS;
+
+  return index < this->blocks.size() &&
+         this->blocks[index] != NULL &&
+         (this->blocks[index]->valid & (1ULL << (sector % GDFS_CACHE_SECTORS)));
+}
+
+
+bool
+File::in_hole (size_t sector) const
+{
+
+  auto it = this->holes.upper_bound(sector);
+
+  return it != this->holes.begin() && std::prev(it)->second > sector;
+}
+
+
+/*
+ * Function to find the end of the bytes from offset on that are
+ * either all in a hole (zero set) or all out of one.
+ */
+static size_t
+hole_end (const std::map <size_t, size_t> & holes,
+          off_t offset,
+          bool & zero)
+{
+
+  size_t sector = offset / GDFS_CACHE_SECTOR_SIZE;
+  auto it = holes.upper_bound(sector);
+
+  zero = (it != holes.begin() && std::prev(it)->second > sector);
+  if (zero) {
+    return std::prev(it)->second * GDFS_CACHE_SECTOR_SIZE;
+  }
+  return (it == holes.end()) ? SIZE_MAX : it->first * GDFS_CACHE_SECTOR_SIZE;
+}
+
+
+/*
+ * Function to take the sectors first upto last (not included)
+ * out of the holes of the file. The file lock must be held.
+ */
+void
+File::cut_hole (size_t first,
+                size_t last)
+{
+
+  size_t first_;
+  size_t last_;
+  auto it = this->holes.upper_bound(first);
+
+  if (it != this->holes.begin()) {
+    --it;
+  }
+
+  while (it != this->holes.end() && it->first < last) {
+    first_ = it->first;
+    last_ = it->second;
+    if (last_ <= first) {
+      ++it;
+      continue;
+    }
+
+    it = this->holes.erase(it);
+    if (first_ < first) {
+      this->holes[first_] = first;
+    }
+    if (last_ > last) {
+      this->holes[last] = last_;
+    }
+  }
+}
+
+
+/*
+ * Function to find whether a byte of the file is being downloaded.
+ * The file lock must be held.
+ */
+bool
+File::is_fetching (off_t offset) const
+{
+  for (auto fe : this->fetches) {
+    if (fe->start <= offset && offset < fe->end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*
+ * Function to add a download of the bytes start to end
+ * into the in-flight list. The file lock must be held.
+ */
+struct Fetch *
+File::begin_fetch (off_t start,
+                   off_t end)
+{
+
+  struct Fetch * fe = new Fetch(start, end, this->generation);
+  assert(fe != NULL);
+  this->fetches.emplace_back(fe);
+
+  return fe;
+}
+
+
+/*
+ * Function to add the sectors of a completed download into the cache,
+ * and to drop it from the in-flight list. The file lock must be held.
+ * Only the sectors received in full (or upto eof) that are not
+ * already in the cache are added. Nothing is added if the file was
+ * dropped or resized in the cache since the download began.
+ */
+void
+File::end_fetch (struct Fetch * fe,
+                 const char * buf,
+                 size_t len,
+                 size_t eof,
+                 size_t & added)
+{
+
+  size_t sector;
+  size_t begin_;
+  size_t n;
+  size_t stop = fe->start + len;
+  struct Block * b = NULL;
+
+  if (fe->generation != this->generation) {
+    goto out;
+  }
+
+  for (sector = fe->start / GDFS_CACHE_SECTOR_SIZE; ; ++sector) {
+    begin_ = sector * GDFS_CACHE_SECTOR_SIZE;
+    if (begin_ >= stop) {
+      break;
+    }
+    n = std::min(stop, begin_ + GDFS_CACHE_SECTOR_SIZE) - begin_;
+    if (n < GDFS_CACHE_SECTOR_SIZE && stop < eof) {
+      break;
+    }
+    if (this->is_valid(sector) || this->in_hole(sector)) {
+      continue;
+    }
+
+    b = this->get_block(begin_ / GDFS_CACHE_BLOCK_SIZE, begin_ % GDFS_CACHE_BLOCK_SIZE + GDFS_CACHE_SECTOR_SIZE, added);
+    memset(b->mem + begin_ % GDFS_CACHE_BLOCK_SIZE, 0, GDFS_CACHE_SECTOR_SIZE);
+    memcpy(b->mem + begin_ % GDFS_CACHE_BLOCK_SIZE, buf + (begin_ - fe->start), n);
+    b->valid |= (1ULL << (sector % GDFS_CACHE_SECTORS));
+  }
+
+out:
+  this->fetches.remove(fe);
+  delete fe;
+  pthread_cond_broadcast(&fetch_cond);
+}
+
+
+/*
+ * Function to load the sectors first to last not in memory,
+ * from the disk cache. The file lock must be held.
+ */
+void
+File::load_disk (size_t first,
+                 size_t last,
+                 size_t & added)
+{
+
+  size_t index;
+  size_t sector;
+  uint64_t want;
+  uint64_t have;
+  struct Block * b = NULL;
+
+  if (this->disk.enabled() == false) {
+    return;
+  }
+
+  for (index = first / GDFS_CACHE_SECTORS; index <= last / GDFS_CACHE_SECTORS; ++index) {
+    want = 0;
+    for (sector = std::max(first, index * GDFS_CACHE_SECTORS);
+         sector <= std::min(last, index * GDFS_CACHE_SECTORS + GDFS_CACHE_SECTORS - 1);
+         ++sector) {
+      if (this->is_valid(sector) == false && this->in_hole(sector) == false &&
+          this->is_fetching(sector * GDFS_CACHE_SECTOR_SIZE) == false) {
+        want |= (1ULL << (sector % GDFS_CACHE_SECTORS));
+      }
+    }
+    if (want == 0) {
+      continue;
+    }
+
+    have = this->disk.lookup(this->id, this->mtime, index) & want;
+    if (have == 0) {
+      continue;
+    }
+
+    // Memory upto the last sector held.
+    b = this->get_block(index, (64 - __builtin_clzll(have)) * GDFS_CACHE_SECTOR_SIZE, added);
+    b->valid |= this->disk.load(this->id, this->mtime, index, have, b->mem);
+  }
+}
+
+
+/*
+ * Function to load the sectors covering the bytes start to stop,
+ * that are not in the cache.
+ * A sector already being downloaded by another thread is waited for,
+ * instead of being downloaded again. The rest are downloaded with
+ * the file lock dropped, runs of missing sectors close to each other
+ * being merged into a single range request.
+ * Bytes beyond the end of the file, or of a file not yet
+ * in Google Drive, are zeros. Holes are left as they are.
+ * Returns false if some of the bytes could not be downloaded,
+ * those being left out of the cache.
+ * The file lock must be held.
+ */
+bool
+File::fill (off_t start,
+            off_t stop,
+            struct GDFSEntry * entry,
+            size_t & added)
+{
+
+  size_t first = start / GDFS_CACHE_SECTOR_SIZE;
+  size_t last = stop / GDFS_CACHE_SECTOR_SIZE;
+  size_t sector;
+  size_t begin_;
+  size_t end_;
+  size_t remote;
+  bool waiting;
+  bool split;
+  bool ok = true;
+  struct Block * b = NULL;
+  std::vector <std::pair <size_t, size_t>> runs;
+  std::vector <std::pair <struct Fetch *, char *>> own;
+
+  for (;;) {
+    this->load_disk(first, last, added);
+
+    remote = (entry->pending_create || entry->g_doc) ? 0 : entry->file_size;
+    waiting = false;
+    split = true;
+    runs.clear();
+
+    for (sector = first; sector <= last; ++sector) {
+      if (this->is_valid(sector) || this->in_hole(sector)) {
+        continue;
+      }
+
+      begin_ = sector * GDFS_CACHE_SECTOR_SIZE;
+      if (begin_ >= remote) {
+        b = this->get_block(begin_ / GDFS_CACHE_BLOCK_SIZE, begin_ % GDFS_CACHE_BLOCK_SIZE + GDFS_CACHE_SECTOR_SIZE, added);
+        memset(b->mem + begin_ % GDFS_CACHE_BLOCK_SIZE, 0, GDFS_CACHE_SECTOR_SIZE);
+        b->valid |= (1ULL << (sector % GDFS_CACHE_SECTORS));
+        continue;
+      }
+
+      if (this->is_fetching(begin_)) {
+        waiting = true;
+        split = true;
+        continue;
+      }
+
+      if (split == false &&
+          (sector - runs.back().second) * GDFS_CACHE_SECTOR_SIZE <= GDFS_FETCH_MERGE_GAP) {
+        runs.back().second = sector + 1;
+      } else {
+        runs.emplace_back(sector, sector + 1);
+      }
+      split = false;
+    }
+
+    if (runs.empty()) {
+      if (waiting == false) {
+        break;
+      }
+      pthread_cond_wait(&fetch_cond, &lock);
+      continue;
+    }
+
+    // Large runs are split into segments, downloaded in parallel.
+    for (auto & r : runs) {
+      end_ = std::min(r.second * GDFS_CACHE_SECTOR_SIZE, remote);
+      for (begin_ = r.first * GDFS_CACHE_SECTOR_SIZE; begin_ < end_; begin_ += GDFS_FETCH_SEGMENT_SIZE) {
+        own.emplace_back(this->begin_fetch(begin_, std::min(end_, begin_ + GDFS_FETCH_SEGMENT_SIZE)),
+                         (char *) NULL);
+      }
+    }
+
+    // Download without holding the file lock.
+    pthread_mutex_unlock(&lock);
+    this->download(own, entry);
+    pthread_mutex_lock(&lock);
+
+    // Only the bytes received are added, the rest are left missing.
+    for (auto & o : own) {
+      if (o.first->ok == false) {
+        ok = false;
+      }
+      this->end_fetch(o.first, o.second, o.first->received, o.first->end, added);
+      delete[] o.second;
+    }
+    own.clear();
+
+    if (ok == false) {
+      break;
+    }
+  }
+
+  return ok;
+}
+
+
+/*
+ * Function to delete all the blocks of a file,
+ * if the file has been modified since it was cached.
+ * Returns the number of bytes freed.
+ */
+size_t
+File::check_mtime (struct GDFSEntry * entry)
+{
+
+  size_t size_ = 0;
+
+  pthread_mutex_lock(&lock);
+  if (entry->mtime > 0) {
+    if (this->mtime == 0) {
+      // First seen since the mount.
+      // The disk cache may still hold it from the last mount.
+      this->mtime = entry->mtime;
+      this->md5 = entry->md5;
+      this->disk.validate(this->id, this->mtime, this->md5);
+    } else if (entry->mtime > this->mtime ||
+               (entry->mtime == this->mtime &&
+                entry->md5.empty() == false && this->md5.empty() == false && entry->md5 != this->md5)) {
+      size_ = this->free_blocks();
+      this->disk.drop(this->id);
+      this->mtime = entry->mtime;
+      this->md5 = entry->md5;
+    } else if (this->md5.empty()) {
+      this->md5 = entry->md5;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return size_;
+}
+
+
+/*
+ * Function to read len bytes of a file from offset,
+ * loading the bytes not in the cache.
+ * If buf is NULL, the bytes are only loaded into the cache.
+ * Returns the number of bytes read, or -EIO if they could
+ * not be downloaded.
+ */
+ssize_t
+File::read (char * buf,
+            off_t offset,
+            size_t len,
+            struct GDFSEntry * entry,
+            size_t & added)
+{
+
+  Debug("<-- Entering File read() -->");
+
+  assert (entry != NULL);
+
+  off_t stop = offset + len - 1;
+  ssize_t size = 0;
+  size_t off;
+  size_t n;
+  bool zero;
+  struct Block * b = NULL;
+
+  pthread_mutex_lock(&lock);
+
+  this->flush_extent(entry, added);
+
+  if (len == 0 ||
+      offset >= (off_t) entry->file_size) {
+    goto out;
+  }
+  stop = std::min(stop, (off_t) entry->file_size - 1);
+
+  if (this->fill(offset, stop, entry, added) == false) {
+    size = -EIO;
+    goto out;
+  }
+
+  size = stop - offset + 1;
+  if (buf != NULL) {
+    for (off = offset; off <= (size_t) stop; off += n) {
+      n = std::min((size_t) stop + 1, hole_end(this->holes, off, zero)) - off;
+      if (zero) {
+        memset(buf + (off - offset), 0, n);
+        continue;
+      }
+      b = this->blocks[off / GDFS_CACHE_BLOCK_SIZE];
+      n = std::min(n, (off / GDFS_CACHE_BLOCK_SIZE + 1) * GDFS_CACHE_BLOCK_SIZE - off);
+      memcpy(buf + (off - offset), b->mem + off % GDFS_CACHE_BLOCK_SIZE, n);
+    }
+  }
+
+out:
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting File read() -->");
+  return size;
+}
+
+
+/*
+ * Function to write len bytes into a file at offset.
+ * Small writes are combined into the extent of the file,
+ * which is copied into the blocks once full, or once the
+ * file is read.
+ * Returns false if the bytes around the write could not
+ * be downloaded, in which case nothing is written.
+ */
+bool
+File::write (const char * buf,
+             off_t offset,
+             size_t len,
+             struct GDFSEntry * entry,
+             size_t & added)
+{
+
+  Debug("<-- Entering File write() -->");
+
+  bool ret = true;
+
+  if (len == 0) {
+    return ret;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (this->combine(buf, offset, len, entry, added) == false) {
+    this->flush_extent(entry, added);
+    ret = this->write_blocks(buf, offset, len, entry, added);
+  }
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting File write() -->");
+  return ret;
+}
+
+
+/*
+ * Function to add a write of less than a sector to the extent.
+ * Larger writes gain nothing from being copied twice.
+ * A write which neither overlaps nor follows the extent starts
+ * a new one, once the old one is copied into the blocks.
+ * The sectors covered only in part are loaded right away,
+ * so that the extent can be copied later without a download.
+ * Returns false if the write is too large, spans blocks,
+ * or if those sectors could not be loaded.
+ * The file lock must be held.
+ */
+bool
+File::combine (const char * buf,
+               off_t offset,
+               size_t len,
+               struct GDFSEntry * entry,
+               size_t & added)
+{
+
+  size_t stop = offset + len - 1;
+  size_t end_;
+
+  if (len >= GDFS_CACHE_SECTOR_SIZE ||
+      (size_t) offset / GDFS_CACHE_BLOCK_SIZE != stop / GDFS_CACHE_BLOCK_SIZE) {
+    return false;
+  }
+
+  if (offset % GDFS_CACHE_SECTOR_SIZE != 0 &&
+      this->is_valid(offset / GDFS_CACHE_SECTOR_SIZE) == false &&
+      this->fill(offset, offset, entry, added) == false) {
+    return false;
+  }
+  if ((stop + 1) % GDFS_CACHE_SECTOR_SIZE != 0 &&
+      this->is_valid(stop / GDFS_CACHE_SECTOR_SIZE) == false &&
+      this->fill(stop, stop, entry, added) == false) {
+    return false;
+  }
+
+  end_ = this->extent_offset + this->extent_len;
+  if (this->extent_len > 0 &&
+      (offset < this->extent_offset || (size_t) offset > end_ ||
+       offset / GDFS_CACHE_BLOCK_SIZE != this->extent_offset / GDFS_CACHE_BLOCK_SIZE)) {
+    this->flush_extent(entry, added);
+  }
+
+  if (this->extent_len == 0) {
+    if (this->extent == NULL) {
+      this->extent = slab.alloc(GDFS_CACHE_BLOCK_SIZE);
+      assert(this->extent != NULL);
+      this->size += GDFS_CACHE_BLOCK_SIZE;
+      added += GDFS_CACHE_BLOCK_SIZE;
+    }
+    this->extent_offset = offset;
+  }
+
+  memcpy(this->extent + offset % GDFS_CACHE_BLOCK_SIZE, buf, len);
+  end_ = this->extent_offset + this->extent_len;
+  if (stop + 1 > end_) {
+    this->dirty_bytes += stop + 1 - end_;
+    this->extent_len = stop + 1 - this->extent_offset;
+  }
+
+  // The disk cache keeps the rest of the file, as of the new mtime.
+  if (this->mtime != entry->mtime) {
+    this->disk.invalidate(this->id, this->mtime, entry->mtime, offset, stop);
+    this->mtime = entry->mtime;
+  }
+  this->md5.clear();
+
+  // Hand the extent over once it reaches the end of its block.
+  if ((this->extent_offset + this->extent_len) % GDFS_CACHE_BLOCK_SIZE == 0) {
+    this->flush_extent(entry, added);
+  }
+
+  return true;
+}
+
+
+/*
+ * Function to copy the extent into the blocks.
+ * The file lock must be held.
+ */
+void
+File::flush_extent (struct GDFSEntry * entry,
+                    size_t & added)
+{
+
+  off_t offset;
+  size_t len;
+
+  while (this->extent_len > 0) {
+    offset = this->extent_offset;
+    len = this->extent_len;
+    this->write_blocks(this->extent + offset % GDFS_CACHE_BLOCK_SIZE, offset, len, entry, added);
+
+    // Unless written to again, had the lock been dropped.
+    if (this->extent_offset == offset && this->extent_len == len) {
+      this->dirty_bytes -= len;
+      this->extent_len = 0;
+    }
+  }
+}
+
+
+/*
+ * Function to write len bytes into the blocks of a file at offset.
+ * Sectors written only in part are loaded first, and the sectors
+ * of a hole are given zeroed memory.
+ * Returns false if a sector written only in part could not be loaded.
+ * The file lock must be held.
+ */
+bool
+File::write_blocks (const char * buf,
+                    off_t offset,
+                    size_t len,
+                    struct GDFSEntry * entry,
+                    size_t & added)
+{
+
+  size_t stop = offset + len - 1;
+  size_t off;
+  size_t n;
+  size_t sector;
+  struct Block * b = NULL;
+
+  for (sector = offset / GDFS_CACHE_SECTOR_SIZE; sector <= stop / GDFS_CACHE_SECTOR_SIZE; ++sector) {
+    if (this->in_hole(sector)) {
+      off = sector * GDFS_CACHE_SECTOR_SIZE;
+      b = this->get_block(off / GDFS_CACHE_BLOCK_SIZE, off % GDFS_CACHE_BLOCK_SIZE + GDFS_CACHE_SECTOR_SIZE, added);
+      memset(b->mem + off % GDFS_CACHE_BLOCK_SIZE, 0, GDFS_CACHE_SECTOR_SIZE);
+      b->valid |= (1ULL << (sector % GDFS_CACHE_SECTORS));
+    }
+  }
+  this->cut_hole(offset / GDFS_CACHE_SECTOR_SIZE, stop / GDFS_CACHE_SECTOR_SIZE + 1);
+
+  if (offset % GDFS_CACHE_SECTOR_SIZE != 0 &&
+      this->fill(offset, offset, entry, added) == false) {
+    return false;
+  }
+  if ((stop + 1) % GDFS_CACHE_SECTOR_SIZE != 0 &&
+      this->fill(stop, stop, entry, added) == false) {
+    return false;
+  }
+
+  for (off = offset; off <= stop; off += n) {
+    n = std::min(stop + 1, (off / GDFS_CACHE_BLOCK_SIZE + 1) * GDFS_CACHE_BLOCK_SIZE) - off;
+    b = this->get_block(off / GDFS_CACHE_BLOCK_SIZE, off % GDFS_CACHE_BLOCK_SIZE + n, added);
+    memcpy(b->mem + off % GDFS_CACHE_BLOCK_SIZE, buf + (off - offset), n);
+  }
+
+  for (sector = offset / GDFS_CACHE_SECTOR_SIZE; sector <= stop / GDFS_CACHE_SECTOR_SIZE; ++sector) {
+    b = this->blocks[sector / GDFS_CACHE_SECTORS];
+    b->valid |= (1ULL << (sector % GDFS_CACHE_SECTORS));
+    this->set_dirty(b, b->dirty | (1ULL << (sector % GDFS_CACHE_SECTORS)));
+  }
+
+  // Update the mtime of the file in the cache.
+  // The disk cache keeps the rest of the file, as of the new mtime.
+  this->disk.invalidate(this->id, this->mtime, entry->mtime, offset, stop);
+  this->mtime = entry->mtime;
+  this->md5.clear();
+
+  return true;
+}
+
+
+/*
+ * Function to track the reads of a file, and to find the range
+ * to read ahead of a sequential read of len bytes at offset.
+ * The window starts at GDFS_READAHEAD_MIN, and is topped up once
+ * half of it is read, doubling every time upto GDFS_READAHEAD_MAX.
+ * A read elsewhere in the file stops it.
+ * Returns the download to make, added into the in-flight list,
+ * or NULL if there is nothing to read ahead.
+ */
+struct Fetch *
+File::readahead (off_t offset,
+                 size_t len,
+                 struct GDFSEntry * entry)
+{
+
+  struct Fetch * fe = NULL;
+  off_t stop = offset + len;
+  off_t start;
+  off_t end_;
+  bool zero;
+
+  if (entry->g_doc || entry->pending_create) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&lock);
+
+  if (offset == this->ra_next) {
+    this->ra_window = std::max(this->ra_window, (size_t) GDFS_READAHEAD_MIN);
+  } else {
+    this->ra_window = 0;
+    this->ra_issued = 0;
+  }
+  this->ra_next = stop;
+
+  if (this->ra_window == 0) {
+    goto out;
+  }
+  if (this->ra_issued - stop >= (off_t) this->ra_window / 2) {
+    goto out;
+  }
+
+  // Grow the window, if the last readahead was read.
+  if (this->ra_issued > offset) {
+    this->ra_window = std::min(this->ra_window * 2, (size_t) GDFS_READAHEAD_MAX);
+  } else {
+    this->ra_issued = stop;
+  }
+
+  // The sector of the last byte read is already in the cache.
+  start = (this->ra_issued + GDFS_CACHE_SECTOR_SIZE - 1) / GDFS_CACHE_SECTOR_SIZE * GDFS_CACHE_SECTOR_SIZE;
+  end_  = std::min((off_t) entry->file_size, stop + (off_t) this->ra_window);
+  this->ra_issued = std::max(this->ra_issued, end_);
+
+  // Skip what is already in the cache, or on its way,
+  // and stop at a hole.
+  while (start < end_ &&
+         (this->is_valid(start / GDFS_CACHE_SECTOR_SIZE) || this->is_fetching(start))) {
+    start += GDFS_CACHE_SECTOR_SIZE;
+  }
+  if (start < end_) {
+    end_ = std::min((size_t) end_, hole_end(this->holes, start, zero));
+    if (zero) {
+      end_ = start;
+    }
+  }
+  if (start < end_) {
+    fe = this->begin_fetch(start, end_);
+  }
+
+out:
+  pthread_mutex_unlock(&lock);
+  return fe;
+}
+
+
+/*
+ * Function to complete a download made without the file lock.
+ */
+void
+File::complete (struct Fetch * fe,
+                const char * buf,
+                size_t len,
+                size_t eof,
+                size_t & added)
+{
+  pthread_mutex_lock(&lock);
+  this->end_fetch(fe, buf, len, eof, added);
+  pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Function to mark the blocks of a file as clean,
+ * once the file is saved in Google Drive.
+ * If the file was uploaded from a snapshot, only the sectors
+ * saved with it are clean, and the snapshot is let go.
+ * Returns the number of bytes freed.
+ */
+size_t
+File::clean (void)
+{
+  pthread_mutex_lock(&lock);
+  if (this->snap == NULL) {
+    for (auto b : this->blocks) {
+      if (b != NULL) {
+        this->set_dirty(b, 0);
+      }
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return this->release_snapshot(true);
+}
 
 
 /*
- * Function to delete all the pages of a file from cache.
+ * Function to take a snapshot of the file to upload.
+ * The blocks with modified sectors are held as they are now,
+ * and the writes from now on go to copies of them,
+ * so that the upload is not held up by the writes, nor mixes
+ * their data with the one it started with.
+ * Returns the size of the file in the snapshot.
  */
-void
-File::delete_pages (void)
+size_t
+File::snapshot (struct GDFSEntry * entry,
+                size_t & added)
+{
+
+  Debug("<-- Entering File snapshot() -->");
+
+  size_t size_;
+  struct Block * b = NULL;
+
+  pthread_mutex_lock(&lock);
+
+  // The writes in the extent are part of the upload.
+  this->flush_extent(entry, added);
+
+  assert(this->snap == NULL);
+  this->snap = new Snapshot();
+  assert(this->snap != NULL);
+
+  this->snap->size = entry->file_size;
+  this->snap->generation = this->generation;
+  this->snap->holes = this->holes;
+  this->snap->blocks.resize(this->blocks.size(), NULL);
+  for (size_t i = 0; i < this->blocks.size(); ++i) {
+    b = this->blocks[i];
+    if (b != NULL && b->dirty != 0) {
+      ++b->refs;
+      this->snap->blocks[i] = b;
+    }
+  }
+  size_ = this->snap->size;
+
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting File snapshot() -->");
+  return size_;
+}
+
+
+/*
+ * Function to find the block holding a sector as it was
+ * in the snapshot. The sectors the snapshot does not hold are
+ * taken from the file, unless changed since the snapshot.
+ * Returns NULL if the sector is to be read from Google Drive.
+ * The file lock must be held.
+ */
+struct Block *
+File::saved_block (size_t sector) const
+{
+
+  size_t index = sector / GDFS_CACHE_SECTORS;
+  uint64_t bit = 1ULL << (sector % GDFS_CACHE_SECTORS);
+  struct Block * b = NULL;
+
+  if (index < this->snap->blocks.size()) {
+    b = this->snap->blocks[index];
+    if (b != NULL && (b->valid & bit)) {
+      return b;
+    }
+  }
+
+  if (this->generation != this->snap->generation ||
+      this->is_valid(sector) == false) {
+    return NULL;
+  }
+  b = this->blocks[index];
+
+  return (b->dirty & bit) ? NULL : b;
+}
+
+
+/*
+ * Function to read len bytes of the snapshot of a file from offset.
+ * Returns the number of bytes read.
+ */
+size_t
+File::read_snapshot (char * buf,
+                     off_t offset,
+                     size_t len,
+                     struct GDFSEntry * entry,
+                     size_t & added)
 {
 
-  Debug("<-- Entering File delete_pages() -->");
+  Debug("<-- Entering File read_snapshot() -->");
+
+  size_t stop;
+  size_t off;
+  size_t end_;
+  size_t n;
+  size_t got;
+  bool zero;
+  struct iovec iov;
+  struct Block * b = NULL;
 
   pthread_mutex_lock(&lock);
+  assert(this->snap != NULL);
+
+  if (len == 0 ||
+      (size_t) offset >= this->snap->size) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  stop = std::min(offset + len, this->snap->size);
 
-  // Delete all the pages.
-  for (auto p : this->pages) {
-    delete p;
+  // Load the sectors of the file left unchanged since.
+  if (this->generation == this->snap->generation) {
+    this->fill(offset, stop - 1, entry, added);
   }
-  this->pages.clear();
 
-  // Reset file size and mtime in cache.
-  this->size = 0;
-  this->mtime = time(NULL);
+  for (off = offset; off < stop; off += n) {
+    end_ = std::min(stop, hole_end(this->snap->holes, off, zero));
+    if (zero) {
+      n = end_ - off;
+      memset(buf + (off - offset), 0, n);
+      continue;
+    }
+
+    n = std::min(end_, (off / GDFS_CACHE_SECTOR_SIZE + 1) * GDFS_CACHE_SECTOR_SIZE) - off;
+    b = this->saved_block(off / GDFS_CACHE_SECTOR_SIZE);
+    if (b != NULL) {
+      memcpy(buf + (off - offset), b->mem + off % GDFS_CACHE_BLOCK_SIZE, n);
+      continue;
+    }
+
+    // Changed since, so read as saved in Google Drive,
+    // along with the next sectors alike.
+    while (off + n < end_ &&
+           this->saved_block((off + n) / GDFS_CACHE_SECTOR_SIZE) == NULL) {
+      n = std::min(end_, off + n + GDFS_CACHE_SECTOR_SIZE) - off;
+    }
+    iov.iov_base = buf + (off - offset);
+    iov.iov_len = n;
+
+    got = 0;
+    if (entry->pending_create == false && entry->g_doc == false) {
+      pthread_mutex_unlock(&lock);
+      got = this->read_file(entry, &iov, 1, off, off + n - 1);
+      pthread_mutex_lock(&lock);
+    }
+
+    if (got < n) {
+      memset(buf + (off - offset) + got, 0, n - got);
+    }
+  }
 
   pthread_mutex_unlock(&lock);
 
-  Debug("<-- Exiting File delete_pages() -->");
+  Debug("<-- Exiting File read_snapshot() -->");
+  return stop - offset;
 }
 
 
 /*
- * Function to read from the cache, given a start and stop position.
- * If any bytes is not present, a new page shall be created.
+ * Function to let go of the snapshot of a file.
+ * If saved, the modified sectors of the file that are still the same
+ * as in the snapshot are marked clean.
+ * Returns the number of bytes freed.
  */
 size_t
-File::get (std::list <struct Page *> & l,
-           off_t start,
-           off_t stop,
-           struct GDFSEntry * entry)
+File::release_snapshot (bool saved)
 {
 
-  Debug("<-- Entering File get() -->");
+  size_t size_ = 0;
+  size_t sector;
+  uint64_t bit;
+  uint64_t mask;
+  struct Block * b = NULL;
+  struct Block * p = NULL;
 
-  assert (entry != NULL);
+  pthread_mutex_lock(&lock);
+  if (this->snap == NULL) {
+    goto out;
+  }
+
+  for (size_t i = 0; i < this->snap->blocks.size(); ++i) {
+    p = this->snap->blocks[i];
+    if (p == NULL) {
+      continue;
+    }
+
+    b = (i < this->blocks.size()) ? this->blocks[i] : NULL;
+    if (saved && b != NULL) {
+      mask = 0;
+      for (sector = 0; sector < GDFS_CACHE_SECTORS; ++sector) {
+        bit = 1ULL << sector;
+        if ((b->dirty & p->dirty & bit) &&
+            (b == p || memcmp(b->mem + sector * GDFS_CACHE_SECTOR_SIZE,
+                              p->mem + sector * GDFS_CACHE_SECTOR_SIZE,
+                              GDFS_CACHE_SECTOR_SIZE) == 0)) {
+          mask |= bit;
+        }
+      }
+      this->set_dirty(b, b->dirty & ~mask);
+    }
+    size_ += this->drop_block(p);
+  }
+  this->size -= size_;
+
+  delete this->snap;
+  this->snap = NULL;
+
+out:
+  pthread_mutex_unlock(&lock);
+  return size_;
+}
+
+
+/*
+ * Function to move the file to the version it is saved as
+ * in Google Drive, along with its copy in the disk cache.
+ * Called once the file is uploaded from the cache, so that
+ * the bytes just uploaded are not downloaded again.
+ */
+void
+File::set_version (time_t mtime_,
+                   const std::string & md5_)
+{
+  pthread_mutex_lock(&lock);
+  this->disk.set_version(this->id, this->mtime, mtime_, md5_);
+  this->mtime = mtime_;
+  this->md5 = md5_;
+  pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Function to take a download slot, waiting while the file
+ * or the cache as a whole has too many downloads running.
+ */
+void
+File::acquire_slot (void)
+{
+  pthread_mutex_lock(&slot_lock);
+  while (this->running >= GDFS_FETCH_FILE_PARALLEL ||
+         running_fetches >= GDFS_FETCH_MAX_PARALLEL) {
+    pthread_cond_wait(&slot_cond, &slot_lock);
+  }
+  ++this->running;
+  ++running_fetches;
+  pthread_mutex_unlock(&slot_lock);
+}
+
+
+void
+File::release_slot (void)
+{
+  pthread_mutex_lock(&slot_lock);
+  --this->running;
+  --running_fetches;
+  pthread_cond_broadcast(&slot_cond);
+  pthread_mutex_unlock(&slot_lock);
+}
+
+
+/*
+ * Function to download the ranges of the in-flight list own,
+ * all of them at once through the async engine, within the
+ * per file and overall limits on parallel downloads.
+ * Every range is received into a buffer of its own, and its
+ * fetch tells how many bytes were received, and whether
+ * the download succeeded.
+ */
+void
+File::download (std::vector <std::pair <struct Fetch *, char *>> & own,
+                struct GDFSEntry * entry)
+{
+
+  Debug("<-- Entering File download() -->");
+
+  size_t pending = own.size();
+  size_t len;
+  struct Fetch * fe = NULL;
+  pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+  std::vector <struct iovec> iov(own.size());
+  std::vector <struct Sink *> sinks(own.size(), NULL);
+  struct Transfer * t = NULL;
+
+  for (size_t i = 0; i < own.size(); ++i) {
+    fe = own[i].first;
+    len = fe->end - fe->start;
+    own[i].second = new char[len]();
+    assert(own[i].second != NULL);
+
+    // A single range is downloaded by the calling thread itself.
+    if (own.size() == 1) {
+      iov[i].iov_base = own[i].second;
+      iov[i].iov_len = len;
+      this->acquire_slot();
+      fe->received = this->read_file(entry, &iov[i], 1, fe->start, fe->end - 1);
+      fe->ok = (fe->received == len);
+      this->release_slot();
+      pending = 0;
+      break;
+    }
+
+    iov[i].iov_base = own[i].second;
+    iov[i].iov_len = len;
+    sinks[i] = new Sink(&iov[i], 1, own[i].first->start, len);
+    assert(sinks[i] != NULL);
+
+    t = new Transfer(GDFS_FILE_URL + entry->file_id + "?alt=media", DOWNLOAD,
+                     "Range: bytes=" + std::to_string(fe->start) + "-" + std::to_string(fe->end - 1));
+    t->sink = sinks[i];
+    t->done = [this, fe, &pending, &done_lock, &done_cond] (struct Transfer & t) -> long {
+      json::Value val;
+
+      // Retry if Drive is busy.
+      if (t.sink->error.empty() == false && t.attempts < 5) {
+        try {
+          val.parse(t.sink->error);
+          if (val["error"]["code"].get() == "503") {
+            return GDFS_RETRY_DELAY;
+          }
+        } catch (GDFSException & err) {
+
+        }
+      }
+      fe->received = t.sink->written;
+      fe->ok = (t.ok && t.sink->error.empty() && t.sink->written == t.sink->expected);
+      if (fe->ok == false) {
+        Error("download of %s from %llu failed: %s", this->id.c_str(), (unsigned long long) fe->start,
+              t.sink->error.empty() ? t.error.c_str() : t.sink->error.c_str());
+      }
+
+      this->release_slot();
+      pthread_mutex_lock(&done_lock);
+      --pending;
+      pthread_cond_signal(&done_cond);
+      pthread_mutex_unlock(&done_lock);
+      return -1;
+    };
+
+    this->acquire_slot();
+    try {
+      this->auth.sendAsync(t);
+    } catch (GDFSException & err) {
+      Error("%s", err.get().c_str());
+      delete t;
+      this->release_slot();
+      pthread_mutex_lock(&done_lock);
+      --pending;
+      pthread_mutex_unlock(&done_lock);
+    }
+  }
+
+  // Wait for all the ranges.
+  pthread_mutex_lock(&done_lock);
+  while (pending > 0) {
+    pthread_cond_wait(&done_cond, &done_lock);
+  }
+  pthread_mutex_unlock(&done_lock);
+
+  for (auto sink : sinks) {
+    delete sink;
+  }
+
+  Debug("<-- Exiting File download() -->");
+}
+
+
+/*
+ * Function to download the bytes start to stop of a file,
+ * straight into iov. Returns the number of bytes received.
+ */
+size_t
+File::read_file (struct GDFSEntry * entry,
+                 const struct iovec * iov,
+                 int iovcnt,
+                 off_t start,
+                 off_t stop)
+{
+
+  Debug("<-- Entering File read_file() -->");
 
-  Page * p   = NULL;
-  char * buf = NULL;
-  size_t len = 0;
-  off_t start_ = 0;
-  off_t stop_  = 0;
-  size_t count  = 0;
   size_t size = 0;
   std::string url;
-  std::string resp;
+  std::string error;
+  json::Value val;
+
+  // Construct the request.
+  url = GDFS_FILE_URL + entry->file_id + "?alt=media";
+
+  // Get the file data.
+retry:
+  try {
+    size = this->auth.sendDownload(url, start, stop, iov, iovcnt, error);
+  } catch (GDFSException & err) {
+    Error("%s", err.get().c_str());
+    size = 0;
+  }
+
+  if (error.empty() == false) {
+    try {
+      val.clear();
+      val.parse(error);
+      if (val["error"]["code"].get() == "503") {
+        error.clear();
+        sleep(1);
+        goto retry;
+      }
+    } catch (GDFSException & err) {
 
-  // If any modifications in the file detected,
-  // delete all the pages.
-  if (entry->mtime > 0) {
-    if (this->mtime == 0) {
-      this->mtime = entry->mtime;
-    } else if (entry->mtime > this->mtime) {
-      this->delete_pages();
-      entry->file_size = 0;
     }
+
+    Error("download of %s from %llu failed: %s", this->id.c_str(), (unsigned long long) start, error.c_str());
   }
 
-  // Check whether a full block is required.
-  if (entry->file_size > 0) {
-    stop = std::min(stop, (off_t) entry->file_size - 1);
+  Debug("<-- Exiting File read_file() -->");
+  return size;
+}
+
+
+/*
+ * Function to drop the writes from new_size onwards from the extent.
+ * The file lock must be held.
+ */
+void
+File::cut_extent (size_t new_size)
+{
+
+  size_t n;
+
+  if (this->extent_len > 0 &&
+      this->extent_offset + this->extent_len > new_size) {
+    n = (new_size > (size_t) this->extent_offset) ? new_size - this->extent_offset : 0;
+    this->dirty_bytes -= this->extent_len - n;
+    this->extent_len = n;
   }
+}
+
+
+/*
+ * Function to drop the bytes of a file from new_size onwards.
+ */
+void
+File::resize (size_t new_size)
+{
+
+  size_t index = (new_size + GDFS_CACHE_BLOCK_SIZE - 1) / GDFS_CACHE_BLOCK_SIZE;
+  size_t off = new_size % GDFS_CACHE_BLOCK_SIZE;
+  size_t sectors = (off + GDFS_CACHE_SECTOR_SIZE - 1) / GDFS_CACHE_SECTOR_SIZE;
+  uint64_t mask = (sectors == GDFS_CACHE_SECTORS) ? ~0ULL : ((1ULL << sectors) - 1);
+  size_t added = 0;
+  struct Block * b = NULL;
 
-  // Check for Google Docs.
   pthread_mutex_lock(&lock);
-  auto f = this->pages.begin();
-  if (entry->g_doc) {
-    if (f != this->pages.end()) {
-      p = *f;
-      l.emplace_front(p);
-    }
-    size = (stop - start + 1);
-    if (this->pages.size() == 1) {
-      pthread_mutex_unlock(&lock);
-      goto out;
+  ++this->generation;
+  this->disk.drop(this->id);
+
+  // Drop the writes and the holes beyond the new size.
+  this->cut_extent(new_size);
+  this->cut_hole((new_size + GDFS_CACHE_SECTOR_SIZE - 1) / GDFS_CACHE_SECTOR_SIZE, SIZE_MAX);
+
+  // Drop the blocks beyond the new size.
+  while (this->blocks.size() > index) {
+    b = this->blocks.back();
+    if (b != NULL) {
+      this->set_dirty(b, 0);
+      this->size -= this->drop_block(b);
     }
+    this->blocks.pop_back();
   }
 
-  while (f != this->pages.end()) {
-    p = *f;
-    if (p->start <= start &&
-        p->stop >= start) {
-      l.emplace_back(p);
-      ++f;
-      break;
+  // Drop the sectors beyond the new size in the last block,
+  // and zero the rest of the last sector.
+  if (off != 0 &&
+      this->blocks.size() == index &&
+      this->blocks.back() != NULL) {
+    b = this->own_block(index - 1, added);
+    b->valid &= mask;
+    this->set_dirty(b, b->dirty & mask);
+
+    if (off < b->capacity) {
+      memset(b->mem + off, 0, std::min(b->capacity, sectors * GDFS_CACHE_SECTOR_SIZE) - off);
     }
-    ++f;
-    ++count;
   }
+
   pthread_mutex_unlock(&lock);
+}
 
-  // Atmost only a single page in the cache.
-  if (f == this->pages.end()) {
-    size = l.empty() ? 0 : l.front()->size;
 
-    // if no more pages are required
-    if (l.size() == 1 &&
-        l.front()->stop >= stop) {
-      goto out;
-    }
-  }
+/*
+ * Function to grow a file from old_size upto new_size.
+ * The new bytes are zeros, kept as a hole without any memory,
+ * whatever the cache or Google Drive held there before.
+ * Only the sector of old_size, if written in part, stays in memory
+ * with the rest of it zeroed, until it is saved in Google Drive.
+ * Returns the number of bytes freed.
+ */
+size_t
+File::extend (size_t old_size,
+              size_t new_size,
+              struct GDFSEntry * entry,
+              size_t & added)
+{
 
-  // If page is not found in file cache.
-  if (l.empty() == true &&
-      f == this->pages.end()) {
-    Debug("page not found in cache. downloading it");
+  Debug("<-- Entering File extend() -->");
 
-    len = stop - start + 1;
-    buf = new char[len];
-    memset(buf, 0, len);
-    assert (buf != NULL);
+  size_t first = (old_size + GDFS_CACHE_SECTOR_SIZE - 1) / GDFS_CACHE_SECTOR_SIZE;
+  size_t last = (new_size + GDFS_CACHE_SECTOR_SIZE - 1) / GDFS_CACHE_SECTOR_SIZE;
+  size_t index;
+  size_t lo;
+  size_t hi;
+  size_t size_ = 0;
+  uint64_t mask;
+  struct Block * b = NULL;
 
-    this->read_file(entry, buf, start, stop);
+  pthread_mutex_lock(&lock);
 
-    p = this->put(buf, start, stop, entry);
-    assert(p != NULL);
-    l.emplace_back(p);
-    size = p->size;
+  // Drop the writes left beyond the old size.
+  this->cut_extent(old_size);
 
-    goto out;
+  if (old_size % GDFS_CACHE_SECTOR_SIZE != 0 &&
+      this->in_hole(old_size / GDFS_CACHE_SECTOR_SIZE) == false) {
+    this->fill(old_size, old_size, entry, added);
+    b = this->get_block(old_size / GDFS_CACHE_BLOCK_SIZE, old_size % GDFS_CACHE_BLOCK_SIZE / GDFS_CACHE_SECTOR_SIZE * GDFS_CACHE_SECTOR_SIZE + GDFS_CACHE_SECTOR_SIZE, added);
+    memset(b->mem + old_size % GDFS_CACHE_BLOCK_SIZE, 0, GDFS_CACHE_SECTOR_SIZE - old_size % GDFS_CACHE_SECTOR_SIZE);
+    this->set_dirty(b, b->dirty | (1ULL << ((first - 1) % GDFS_CACHE_SECTORS)));
   }
 
-  // retrieve from file cache.
-  pthread_mutex_lock(&lock);
-  while (f != this->pages.end() &&
-         stop >= (*f)->stop) {
-    if (l.back()->stop + 1 != (*f)->start) {
-      // missing page between two pages.
-      // retrieve the page.
-      start_ = l.back()->stop + 1;
-      stop_ = (*f)->start - 1;
-      len = stop_ - start_ + 1;
-      buf = new char[len];
-      assert (buf != NULL);
-      this->read_file(entry, buf, start_, stop_);
-
-      // Add it into cache.
-      Page * p = this->put(buf, start_, stop_, entry);
-      assert (p != NULL);
-      l.emplace_back(p);
-      size += p->size;
-    }
-    l.emplace_back(*f);
-    size += (*f)->size;
-    ++f;
+  if (first < last) {
+    this->cut_hole(first, last);
+    this->holes[first] = last;
+
+    // Drop the sectors the cache holds of the hole.
+    for (index = first / GDFS_CACHE_SECTORS;
+         index < this->blocks.size() && index * GDFS_CACHE_SECTORS < last;
+         ++index) {
+      b = this->blocks[index];
+      if (b == NULL) {
+        continue;
+      }
+
+      lo = std::max(first, index * GDFS_CACHE_SECTORS) - index * GDFS_CACHE_SECTORS;
+      hi = std::min(last, (index + 1) * GDFS_CACHE_SECTORS) - index * GDFS_CACHE_SECTORS;
+      mask = ((hi == GDFS_CACHE_SECTORS) ? ~0ULL : ((1ULL << hi) - 1)) & ~((1ULL << lo) - 1);
+      if ((b->valid & ~mask) == 0 &&
+          (this->extent_len == 0 || index != (size_t) this->extent_offset / GDFS_CACHE_BLOCK_SIZE)) {
+        this->set_dirty(b, 0);
+        size_ += this->drop_block(b);
+        this->blocks[index] = NULL;
+        continue;
+      }
+
+      b = this->own_block(index, added);
+      b->valid &= ~mask;
+      this->set_dirty(b, b->dirty & ~mask);
+    }
+    while (this->blocks.empty() == false && this->blocks.back() == NULL) {
+      this->blocks.pop_back();
+    }
   }
+
+  // The disk cache keeps the rest of the file, as of the new mtime.
+  this->disk.invalidate(this->id, this->mtime, entry->mtime, old_size, old_size);
+  this->mtime = entry->mtime;
+  this->md5.clear();
+  this->size -= size_;
+
   pthread_mutex_unlock(&lock);
 
-  // Check for any more missing pages.
-  if (l.back()->stop < stop) {
-    start_ = l.back()->stop + 1;
-    len = stop - start_ + 1;
-    buf = new char[len];
-    assert(buf != NULL);
-    this->read_file(entry, buf, start_, stop);
+  Debug("<-- Exiting File extend() -->");
+  return size_;
+}
+
+
+LRUCache::~LRUCache (void)
+{
+
+  Debug("<-- Entering LRUCache destructor -->");
+
+  // Stop the reclaimer before the files go away.
+  if (this->reclaim_running) {
+    pthread_mutex_lock(&reclaim_lock);
+    this->reclaim_stop = true;
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+    pthread_join(this->reclaimer, NULL);
+  }
 
-    // Add it into cache.
-    Page * p = this->put(buf, start, stop, entry);
-    assert (p != NULL);
-    l.emplace_back(p);
-    size += p->size;
+  // Wait for the readaheads still in flight.
+  pthread_mutex_lock(&readahead_lock);
+  while (this->readaheads > 0) {
+    pthread_cond_wait(&readahead_cond, &readahead_lock);
   }
+  pthread_mutex_unlock(&readahead_lock);
 
+  if (this->trace != NULL) {
+    fclose(this->trace);
+    this->trace = NULL;
+  }
 
-out:
-  if (entry->g_doc == false) {
-    pthread_mutex_lock(&lock);
-    entry->file_size = 0;
-    for (Page * p : this->pages) {
-      entry->file_size += p->size;
+  // The files are deleted along with the shards.
+  pthread_cond_destroy(&readahead_cond);
+  pthread_mutex_destroy(&readahead_lock);
+  pthread_cond_destroy(&dirty_cond);
+  pthread_mutex_destroy(&dirty_lock);
+  pthread_mutex_destroy(&trace_lock);
+  pthread_cond_destroy(&reclaim_cond);
+  pthread_mutex_destroy(&reclaim_lock);
+  pthread_mutex_destroy(&evict_lock);
+
+  Debug("<-- Exiting LRUCache destructor -->");
+}
+
+
+/*
+ * Function to set the eviction policy of every shard.
+ * An unknown policy falls back to LRU.
+ */
+void
+LRUCache::set_policy (const std::string & name)
+{
+
+  CachePolicy * policy = NULL;
+
+  for (unsigned i = 0; i < GDFS_CACHE_SHARDS; ++i) {
+    policy = CachePolicy::create(name);
+    if (policy == NULL) {
+      Error("Unknown cache policy %s, using lru", name.c_str());
+      policy = new LRUPolicy();
     }
-    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_lock(&this->shards[i].lock);
+    delete this->shards[i].policy;
+    this->shards[i].policy = policy;
+    for (auto & it : this->shards[i].map) {
+      policy->access(it.first, false);
+    }
+    pthread_mutex_unlock(&this->shards[i].lock);
   }
+}
 
-  Debug("<-- Exiting File get() -->");
-  return size;
+
+/*
+ * Function to write an access to the trace file.
+ */
+void
+LRUCache::record (const std::string & file_id,
+                  off_t offset,
+                  size_t len)
+{
+  if (this->trace == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&trace_lock);
+  fprintf(this->trace, "%s %lld %zu\n", file_id.c_str(), (long long) offset, len);
+  pthread_mutex_unlock(&trace_lock);
 }
 
 
-struct Page *
-File::put (char * buf,
-           off_t start,
-           off_t stop,
-           struct GDFSEntry * entry)
+/*
+ * Function to find the shard of the cache that holds a file.
+ */
+struct CacheShard &
+LRUCache::get_shard (const std::string & file_id)
 {
+  return this->shards[std::hash <std::string>()(file_id) % GDFS_CACHE_SHARDS];
+}
 
-  Debug("<-- Entering File put() -->");
 
-  off_t start_;
-  Page * p = NULL;
+/*
+ * Function to start the thread that keeps the cache
+ * below its high watermark.
+ */
+void
+LRUCache::start_reclaim (void)
+{
+  unsigned high = std::min(cache_high_watermark, 100U);
+  unsigned low = std::min(cache_low_watermark, high);
+
+  this->high_mark = (size_t) GDFS_CACHE_MAX_SIZE / 100 * high;
+  this->low_mark = (size_t) GDFS_CACHE_MAX_SIZE / 100 * low;
 
-  pthread_mutex_lock(&lock);
+  if (pthread_create(&this->reclaimer, NULL, reclaim, this) == 0) {
+    this->reclaim_running = true;
+  } else {
+    Error("Unable to start the cache reclaimer, evicting inline");
+  }
+}
+
+
+/*
+ * Function run by the reclaimer thread.
+ * Once the cache grows past the high watermark, it is trimmed
+ * down to the low watermark. If the files left are all modified
+ * and cannot be evicted yet, the next try is a second later.
+ */
+void *
+LRUCache::reclaim (void * arg)
+{
+
+  LRUCache * obj = (LRUCache *) arg;
+  struct timespec ts;
+  uint64_t start = 0;
+  size_t freed = 0;
+  bool stuck = false;
+
+  pthread_mutex_lock(&obj->reclaim_lock);
+  while (obj->reclaim_stop == false) {
+    if (obj->size < obj->high_mark || stuck) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      if (pthread_cond_timedwait(&obj->reclaim_cond, &obj->reclaim_lock, &ts) == ETIMEDOUT) {
+        stuck = false;
+      }
+      continue;
+    }
+    pthread_mutex_unlock(&obj->reclaim_lock);
+
+    start = now_ms();
+    freed = obj->shrink(obj->low_mark);
+
+    pthread_mutex_lock(&obj->reclaim_lock);
+    obj->evict_stats.reclaimed += freed;
+    obj->evict_stats.reclaim_ms += now_ms() - start;
+    ++obj->evict_stats.runs;
+    stuck = (obj->size > obj->low_mark);
+  }
+  pthread_mutex_unlock(&obj->reclaim_lock);
+
+  return NULL;
+}
 
-  auto f = this->pages.begin();
-  if (this->pages.empty() == true) {
-    p = new Page(buf, start, stop);
-    assert (p != NULL);
-    this->pages.emplace(p);
-    this->size = p->size;
-  } else {
-    start_ = start;
-    while (f != this->pages.end()) {
-      p = *f;
-      if (p->stop < start_) {
-        ++f;
-        continue;
-      }
 
-      // If the new page can be inserted between two existing pages.
-      if (p->start > stop) {
-        p = new Page(buf, start, stop);
-        assert (p != NULL);
-        this->pages.emplace(p);
-        this->size = p->size;
-        break;
-      }
+/*
+ * Function to evict files until the cache holds
+ * no more than target bytes.
+ * Files are evicted from the tail of each shard in turn,
+ * holding only one shard lock at any time.
+ * The files left with dirty blocks go back into the policy,
+ * so that they can be evicted once saved.
+ * Returns the number of bytes freed.
+ */
+size_t
+LRUCache::shrink (size_t target)
+{
 
-      if (p->stop >= stop) {
-        memcpy(p->mem + (start_ - p->start), buf + (start_ - start), stop - start_ + 1);
-        break;
-      } else {
-        memcpy(p->mem + (start_ - p->start), buf + (start_ - start), p->stop - start_ + 1);
-        start_ = p->stop + 1;
+  unsigned count = 0;
+  size_t freed = 0;
+  size_t evicted = 0;
+  bool kept = false;
+  std::string victim;
+  std::vector <std::string> dirty_files;
+
+  // Only one thread evicts at a time.
+  // Every shard gives up the files its policy picks.
+  pthread_mutex_lock(&evict_lock);
+  while (this->size > target &&
+         count++ < GDFS_CACHE_SHARDS) {
+    struct CacheShard & shard = this->shards[this->evict_next];
+    this->evict_next = (this->evict_next + 1) % GDFS_CACHE_SHARDS;
+
+    pthread_mutex_lock(&shard.lock);
+    while (this->size > target &&
+           shard.policy->evict(victim)) {
+      auto it = shard.map.find(victim);
+      if (it != shard.map.end()) {
+        evicted = it->second->evict(kept);
+        this->size -= evicted;
+        freed += evicted;
+        if (kept) {
+          dirty_files.emplace_back(victim);
+        }
       }
-      ++f;
     }
-    if (f == this->pages.end()) {
-      p = new Page(buf + (start_ - start), start_, stop);
-      assert (p != NULL);
-      this->pages.emplace(p);
-      this->size += p->size;
+    for (auto & id : dirty_files) {
+      shard.policy->access(id, false);
     }
+    dirty_files.clear();
+    pthread_mutex_unlock(&shard.lock);
   }
+  pthread_mutex_unlock(&evict_lock);
 
-  // Update the mtime of the file in the cache.
-  this->mtime = entry->mtime;
-
-  pthread_mutex_unlock(&lock);
-
-  Debug("<-- Exiting File put() -->");
-  return p;
+  return freed;
 }
 
 
-int
-File::read_file (struct GDFSEntry * entry,
-                 char * buf,
-                 off_t & start,
-                 off_t & stop)
+/*
+ * Function to make sure that there is atleast
+ * size_ bytes free in the cache.
+ * Past the high watermark, the reclaimer is woken up to make room
+ * in the background. The calling thread evicts by itself only if
+ * the cache is full before the reclaimer caught up.
+ */
+void
+LRUCache::free_cache (size_t size_)
 {
 
-  Debug("<-- Entering File read_file() -->");
+  Debug("<-- Entering free_cache() -->");
 
-  bool ret = false;
-  size_t size;
-  size_t len = stop - start + 1;
-  std::string url;
-  std::string query;
-  std::string resp;
-  json::Value val;
+  uint64_t start = 0;
 
+  // Size required is greater than the max size of cache.
+  if (size_ > GDFS_CACHE_MAX_SIZE) {
+    goto out;
+  }
 
-  if (entry->g_doc) {
-    return 0;
+  if (this->size + size_ >= this->high_mark && this->reclaim_running) {
+    pthread_mutex_lock(&reclaim_lock);
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
   }
 
-  // Construct the request.
-  url = GDFS_FILE_URL + entry->file_id + "?alt=media";
-  query = "Range: bytes=" + std::to_string(start) + "-" + std::to_string(stop);
+  // Free space available in the cache.
+  if (this->size + size_ < GDFS_CACHE_MAX_SIZE) {
+    goto out;
+  }
 
-  // Get the file data.
-retry:
-  try {
-    resp = this->auth.sendRequest(url, DOWNLOAD, query);
+  // Need to free some space right away.
+  start = now_ms();
+  this->shrink(size_ < GDFS_CACHE_MAX_SIZE ? GDFS_CACHE_MAX_SIZE - size_ - 1 : 0);
 
-    val.clear();
-    if (val.is_json(resp) == true) {
-      throw GDFSException("read returns JSON string");
-    }
+  pthread_mutex_lock(&reclaim_lock);
+  ++this->evict_stats.stalls;
+  this->evict_stats.stall_ms += now_ms() - start;
+  pthread_mutex_unlock(&reclaim_lock);
 
-    ret = true;
-  } catch (GDFSException & err) {
-    try {
-      val.parse(resp);
-      if (val["error"]["code"].get() == "503") {
-        sleep(1);
-        goto retry;
-      }
-    } catch (GDFSException & err) {
+out:
+  Debug("<-- Exiting free_cache() -->");
+}
 
-    }
-  }
 
-  if (ret) {
-    size = resp.size();
-    size = (size > len ? len : size);
-    stop = size + start - 1;
-    memcpy(buf, resp.c_str(), size);
+/*
+ * Function to account for bytes added to the cache,
+ * making room for them first.
+ */
+void
+LRUCache::add_size (size_t added_size)
+{
+  if (added_size > 0) {
+    this->free_cache(added_size);
+    this->size += added_size;
   }
-
-  Debug("<-- Exiting File read_file() -->");
-  return resp.size();
 }
 
 
+/*
+ * Function to read ahead of a sequential read, if required.
+ * The bytes are downloaded in the background, and added into
+ * the cache once received.
+ */
 void
-File::resize (size_t new_size)
+LRUCache::readahead (const std::string & file_id,
+                     struct File * f,
+                     struct GDFSEntry * entry,
+                     off_t offset,
+                     size_t len)
 {
 
-  Page * p = NULL;
-  size_t offset = new_size - 1;
-  size_t size_ = 0;
+  off_t start = 0;
+  size_t length = 0;
+  size_t eof = entry->file_size;
+  char * buf = NULL;
+  struct iovec * iov = NULL;
+  struct Sink * sink = NULL;
+  struct Fetch * fe = NULL;
+  struct Transfer * t = NULL;
+  size_t added_size = 0;
 
-  for (auto it = this->pages.rbegin(); it != this->pages.rend(); ++it) {
-    p = *it;
-    if (p->start > offset) {
-      size_ = p->size;
-      delete p;
-      this->pages.erase(std::next(it).base());
-      this->size -= size_;
-    } else if (p->stop == offset) {
-      break;
-    } else if (p->stop > offset && p->start < offset) {
-      size_ = p->size;
-      p->stop = offset;
-      p->size = (p->stop - p->start + 1);
-      p->mem[p->size] = 0;
-      this->size -= (size_ - p->size);
-      break;
-    } else if (p->start == offset) {
-      size_ = p->size;
-      p->start = offset;
-      p->stop = offset;
-      p->size = 1;
-      this->size -= (size_ - p->size);
-      break;
+  fe = f->readahead(offset, len, entry);
+  if (fe == NULL) {
+    return;
+  }
+  start = fe->start;
+  length = fe->end - fe->start;
+
+  Debug("reading ahead %llu bytes of %s from %llu", (unsigned long long) length,
+        file_id.c_str(), (unsigned long long) start);
+
+  buf = new char[length];
+  iov = new struct iovec;
+  iov->iov_base = buf;
+  iov->iov_len = length;
+  sink = new Sink(iov, 1, start, length);
+
+  t = new Transfer(GDFS_FILE_URL + file_id + "?alt=media", DOWNLOAD,
+                   "Range: bytes=" + std::to_string(start) + "-" + std::to_string(start + length - 1));
+  t->sink = sink;
+  t->done = [this, f, fe, buf, iov, sink, eof] (struct Transfer & t) -> long {
+    size_t added_size = 0;
+    json::Value val;
+
+    if (t.ok && sink->error.empty()) {
+      f->complete(fe, buf, sink->written, eof, added_size);
+      this->add_size(added_size);
+    } else {
+      if (sink->error.empty() == false && t.attempts < 5) {
+        try {
+          val.parse(sink->error);
+          if (val["error"]["code"].get() == "503") {
+            return GDFS_RETRY_DELAY;
+          }
+        } catch (GDFSException & err) {
+
+        }
+      }
+      f->complete(fe, buf, 0, eof, added_size);
     }
+
+    delete[] buf;
+    delete iov;
+    delete sink;
+    this->end_readahead();
+    return -1;
+  };
+
+  pthread_mutex_lock(&readahead_lock);
+  ++this->readaheads;
+  pthread_mutex_unlock(&readahead_lock);
+  try {
+    this->auth.sendAsync(t);
+  } catch (GDFSException & err) {
+    Error("readahead of %s: %s", file_id.c_str(), err.get().c_str());
+    f->complete(fe, buf, 0, eof, added_size);
+    delete t;
+    delete sink;
+    delete iov;
+    delete[] buf;
+    this->end_readahead();
   }
+}
 
-  if (this->pages.empty()) {
-    this->pages.clear();
+
+/*
+ * Function to count a readahead out,
+ * waking up the destructor once none is left in flight.
+ */
+void
+LRUCache::end_readahead (void)
+{
+  pthread_mutex_lock(&readahead_lock);
+  if (--this->readaheads == 0) {
+    pthread_cond_broadcast(&readahead_cond);
   }
+  pthread_mutex_unlock(&readahead_lock);
 }
 
 
-LRUCache::~LRUCache (void)
+/*
+ * Function to find a file in the cache, creating it if not found.
+ * The access of len bytes from offset is passed on to the policy.
+ */
+struct File *
+LRUCache::get_file (const std::string & file_id,
+                    off_t offset,
+                    size_t len)
 {
 
-  Debug("<-- Entering LRUCache destructor -->");
-  
-  while (map.empty() == false) {
-    auto it = this->map.begin();
-    delete it->second->second;
-    this->cache.erase(it->second);
-    this->map.erase(it);
+  File * f = NULL;
+  struct CacheShard & shard = this->get_shard(file_id);
+
+  this->record(file_id, offset, len);
+
+  pthread_mutex_lock(&shard.lock);
+  auto it = shard.map.find(file_id);
+  if (it == shard.map.end()) {
+    Debug("File %s not found in cache. Creating new entry", file_id.c_str());
+    f = new File(this->auth, this->disk, this->dirty, file_id);
+    assert (f != NULL);
+    shard.map.emplace(file_id, f);
+  } else {
+    f = it->second;
   }
+  shard.policy->access(file_id, f->touch(offset, len));
+  pthread_mutex_unlock(&shard.lock);
 
-  Debug("<-- Exiting LRUCache destructor -->");
+  return f;
 }
 
 
 /*
- * Function to make sure that there is atleast
- * size_ bytes free in the cache.
+ * Function to load a range of a file into the cache,
+ * without reading it out.
  */
 void
-LRUCache::free_cache (size_t size_)
+LRUCache::load (const std::string & file_id,
+                off_t offset,
+                size_t len,
+                struct GDFSNode * node)
 {
 
-  Debug("<-- Entering free_cache() -->");
+  Debug("<-- Entering LRUCache load() -->");
 
-  // Size required is greater than the max size of cache.
-  if (size_ > GDFS_CACHE_MAX_SIZE) {
-    goto out;
-  }
+  File * f = NULL;
+  size_t added_size = 0;
 
-  // Free space available in the cache.
-  if (this->size + size_ < GDFS_CACHE_MAX_SIZE) {
+  if (len == 0) {
     goto out;
   }
 
-  // Need to free some space.
-  while (this->cache.empty() == false) {
-    auto it = this->cache.rbegin();
-    this->size -= it->second->size;
-    it->second->delete_pages();
+  f = this->get_file(file_id, offset, len);
+  this->size -= f->check_mtime(node->entry);
 
-    if (this->size + size_ < GDFS_CACHE_MAX_SIZE) {
-      goto out;
-    }
-  }
+  f->read(NULL, offset, len, node->entry, added_size);
+  this->add_size(added_size);
 
 out:
-  Debug("<-- Exiting free_cache() -->");
+  Debug("<-- Exiting LRUCache load() -->");
 }
 
 
-size_t
+ssize_t
 LRUCache::get (const std::string & file_id,
                char * buffer,
                off_t offset,
                size_t len,
-               struct GDFSNode * node)
+               struct GDFSNode * node,
+               bool readahead)
 {
 
   Debug("<-- Entering LRUCache get() -->");
@@ -466,67 +2100,23 @@ LRUCache::get (const std::string & file_id,
   assert(offset >= 0);
   assert(buffer != NULL);
 
-  Page * p = NULL;
   File * f = NULL;
-  off_t start = offset;
-  off_t stop = offset + len - 1;
-  size_t size_read = 0;
-  size_t size_r = 0;
+  ssize_t size_read = 0;
   size_t added_size = 0;
-  size_t size_begin = 0;
-  std::list <struct Page *> l;
-  auto it = this->map.find(file_id);
 
   memset(buffer, 0, len);
 
-  // Find the file in the cache.
-  // Make it the Most Recently Used.
-  if (it == map.end()) {
-    Debug("File %s not found in cache. Creating new entry", node->file_name.c_str());
-    f = new File(this->auth);
-    assert (f != NULL);
-    this->cache.emplace_front(file_id, f);
-    this->map.emplace(file_id, cache.begin());
-    size_begin = 0;
-  } else {
-    f = it->second->second;
-    this->cache.splice(cache.begin(), cache, it->second);
-    size_begin = f->size;
-  }
-
-  // Load the page into the cache, if not in cache.
-  size_read = f->get(l, start, stop, node->entry);
-  if (l.empty() == true) {
-    goto out;
-  }
-  added_size = f->size - size_begin;
+  f = this->get_file(file_id, offset, len);
+  this->size -= f->check_mtime(node->entry);
 
-  // Only a single page.
-  p = l.front();
-  l.pop_front();
-  if (l.empty() == true) {
-    memcpy(buffer, p->mem + (start - p->start), size_read);
-  }
+  // Load the missing blocks into the cache, and read them out.
+  size_read = f->read(buffer, offset, len, node->entry, added_size);
+  this->add_size(added_size);
 
-  // Read the rest of the pages.
-  else {
-    memcpy(buffer, p->mem + (start - p->start), p->stop - start + 1);
-    size_r += p->stop - start + 1;
-    while (l.size() > 1) {
-      p = l.front();
-      memcpy(buffer + size_r, p->mem, p->stop - p->start + 1);
-      size_r += p->stop - p->start + 1;
-      l.pop_front();
-    }
-    p = l.front();
-    l.pop_front();
-    memcpy(buffer + size_r, p->mem, size_read - size_r);
+  if (readahead && size_read > 0) {
+    this->readahead(file_id, f, node->entry, offset, size_read);
   }
 
-  free_cache(added_size);
-  this->size += added_size;
-
-out:
   Debug("<-- Exiting LRUCache get() -->");
   return size_read;
 }
@@ -544,44 +2134,31 @@ LRUCache::put (const std::string & file_id,
   Debug("<-- Entering LRUCache put() -->");
 
   bool ret = true;
-  char * new_buf = NULL;
   File * f = NULL;
-  off_t start = offset;
-  off_t stop  = offset + len - 1;
+  size_t added_size = 0;
 
   // Find the file in cache.
-  // Make it Most Recently Used.
-  auto it = map.find(file_id);
-  if (it == map.end()) {
-    f = new File(this->auth);
-    assert (f != NULL);
-    cache.emplace_front(file_id, f);
-    map.emplace(file_id, cache.begin());
-  } else {
-    f = it->second->second;
-    cache.splice(cache.begin(), cache, it->second);
+  f = this->get_file(file_id, offset, len);
 
-    // If the file page has been downloaded from Google Drive,
-    // the entire file may have changed. Remove all the pages.
-    if (to_delete) {
-      this->size -= f->size;
-      f->delete_pages();
-    }
+  // If the file page has been downloaded from Google Drive,
+  // the entire file may have changed. Remove all the pages.
+  if (to_delete) {
+    this->size -= f->delete_blocks();
   }
 
-  // Make sure that cache has enough free space to place the new page.
+  // Make sure that cache has enough free space to place the new bytes.
   if (len > 0) {
     this->free_cache(len);
   }
 
-  // Add the page into the cache.
-  if (buffer != NULL &&
-      (len > 0 && stop >= start)) {
-    new_buf = new char[len];
-    assert(new_buf != NULL);
-    memcpy(new_buf, buffer, len);
-    f->put(new_buf, start, stop, node->entry);
-    this->size += len;
+  // Write the bytes into the blocks of the file.
+  if (buffer != NULL && len > 0) {
+    ret = f->write(buffer, offset, len, node->entry, added_size);
+    this->size += added_size;
+
+    pthread_mutex_lock(&dirty_lock);
+    this->dirty_stats.peak = std::max(this->dirty_stats.peak, (uint64_t) this->dirty);
+    pthread_mutex_unlock(&dirty_lock);
   }
 
   Debug("<-- Exiting LRUCache put() -->");
@@ -596,14 +2173,17 @@ LRUCache::remove (const std::string & file_id)
   Debug("<-- Entering LRUCache remove() -->");
 
   File * f = NULL;
-
-  auto it = map.find(file_id);
-  if (it != map.end()) {
-    f = it->second->second;
-    f->delete_pages();
-    this->cache.erase(it->second);
-    this->map.erase(it);
+  struct CacheShard & shard = this->get_shard(file_id);
+
+  pthread_mutex_lock(&shard.lock);
+  auto it = shard.map.find(file_id);
+  if (it != shard.map.end()) {
+    f = it->second;
+    this->size -= f->delete_blocks();
+    shard.policy->remove(file_id);
+    shard.map.erase(it);
   }
+  pthread_mutex_unlock(&shard.lock);
 
   Debug("<-- Exiting LRUCache remove() -->");
 
@@ -619,22 +2199,135 @@ LRUCache::change (const std::string & file_id,
 
   assert (file_id != new_file_id);
 
-  auto it = this->map.find(file_id);
-  assert (it != this->map.end());
+  File * f = NULL;
+  struct CacheShard & shard = this->get_shard(file_id);
+  struct CacheShard & new_shard = this->get_shard(new_file_id);
+
+  // Take the file out of its shard.
+  pthread_mutex_lock(&shard.lock);
+  auto it = shard.map.find(file_id);
+  assert (it != shard.map.end());
+  f = it->second;
+  shard.policy->remove(file_id);
+  shard.map.erase(it);
+  pthread_mutex_unlock(&shard.lock);
 
   this->remove(new_file_id);
 
-  this->cache.emplace_front(new_file_id, it->second->second);
-  this->map.emplace(new_file_id, this->cache.begin());
+  pthread_mutex_lock(&f->lock);
+  f->id = new_file_id;
+  this->disk.rename(file_id, new_file_id);
+  pthread_mutex_unlock(&f->lock);
 
-  this->cache.erase(it->second);
-  this->map.erase(it);
+  // And put it into the shard of the new file id.
+  pthread_mutex_lock(&new_shard.lock);
+  new_shard.map.emplace(new_file_id, f);
+  new_shard.policy->access(new_file_id, false);
+  pthread_mutex_unlock(&new_shard.lock);
 
   Debug("<-- Exiting LRUCache change() -->");
 
 }
 
 
+/*
+ * Function to mark a file as clean in the cache,
+ * once it is saved in Google Drive.
+ */
+void
+LRUCache::clean (const std::string & file_id)
+{
+
+  Debug("<-- Entering LRUCache clean() -->");
+
+  struct CacheShard & shard = this->get_shard(file_id);
+
+  pthread_mutex_lock(&shard.lock);
+  auto it = shard.map.find(file_id);
+  if (it != shard.map.end()) {
+    this->size -= it->second->clean();
+  }
+  pthread_mutex_unlock(&shard.lock);
+
+  // Wake up the writes held back for the dirty data.
+  pthread_mutex_lock(&dirty_lock);
+  pthread_cond_broadcast(&dirty_cond);
+  pthread_mutex_unlock(&dirty_lock);
+
+  Debug("<-- Exiting LRUCache clean() -->");
+}
+
+
+/*
+ * Function to take a snapshot of a file to upload.
+ * Returns the size of the file in the snapshot.
+ */
+size_t
+LRUCache::snapshot (const std::string & file_id,
+                    struct GDFSNode * node)
+{
+
+  Debug("<-- Entering LRUCache snapshot() -->");
+
+  File * f = NULL;
+  size_t size_ = 0;
+  size_t added_size = 0;
+
+  f = this->get_file(file_id, 0, 0);
+  size_ = f->snapshot(node->entry, added_size);
+  this->add_size(added_size);
+
+  Debug("<-- Exiting LRUCache snapshot() -->");
+  return size_;
+}
+
+
+size_t
+LRUCache::get_snapshot (const std::string & file_id,
+                        char * buffer,
+                        off_t offset,
+                        size_t len,
+                        struct GDFSNode * node)
+{
+
+  Debug("<-- Entering LRUCache get_snapshot() -->");
+
+  File * f = NULL;
+  size_t size_read = 0;
+  size_t added_size = 0;
+
+  f = this->get_file(file_id, offset, len);
+  size_read = f->read_snapshot(buffer, offset, len, node->entry, added_size);
+  this->add_size(added_size);
+
+  Debug("<-- Exiting LRUCache get_snapshot() -->");
+  return size_read;
+}
+
+
+/*
+ * Function to let go of the snapshot of a file,
+ * once its upload has failed.
+ */
+void
+LRUCache::release (const std::string & file_id)
+{
+
+  Debug("<-- Entering LRUCache release() -->");
+
+  struct CacheShard & shard = this->get_shard(file_id);
+
+  pthread_mutex_lock(&shard.lock);
+  auto it = shard.map.find(file_id);
+  if (it != shard.map.end()) {
+    this->size -= it->second->release_snapshot(false);
+  }
+  pthread_mutex_unlock(&shard.lock);
+
+  Debug("<-- Exiting LRUCache release() -->");
+}
+
+
 void
 LRUCache::set_time (const std::string & file_id,
                     time_t mtime)
@@ -642,15 +2335,45 @@ LRUCache::set_time (const std::string & file_id,
 
   Debug("<-- Entering LRUCache set_time() -->");
 
-  auto it = this->map.find(file_id);
-  assert (it != this->map.end());
+  struct CacheShard & shard = this->get_shard(file_id);
+
+  pthread_mutex_lock(&shard.lock);
+  auto it = shard.map.find(file_id);
+  assert (it != shard.map.end());
 
-  it->second->second->mtime = mtime;
+  // The checksum is not known until the file is uploaded.
+  it->second->set_version(mtime, "");
+  pthread_mutex_unlock(&shard.lock);
 
   Debug("<-- Exiting LRUCache set_time() -->");
 }
 
 
+/*
+ * Function to set the version of a file in the cache
+ * to the one Google Drive saved it as.
+ */
+void
+LRUCache::set_version (const std::string & file_id,
+                       time_t mtime,
+                       const std::string & md5)
+{
+
+  Debug("<-- Entering LRUCache set_version() -->");
+
+  struct CacheShard & shard = this->get_shard(file_id);
+
+  pthread_mutex_lock(&shard.lock);
+  auto it = shard.map.find(file_id);
+  if (it != shard.map.end()) {
+    it->second->set_version(mtime, md5);
+  }
+  pthread_mutex_unlock(&shard.lock);
+
+  Debug("<-- Exiting LRUCache set_version() -->");
+}
+
+
 void
 LRUCache::resize (const std::string & file_id,
                   size_t new_size)
@@ -660,15 +2383,143 @@ LRUCache::resize (const std::string & file_id,
 
   size_t size_ = 0;
   File * f = NULL;
+  struct CacheShard & shard = this->get_shard(file_id);
 
-  auto it = this->map.find(file_id);
-  assert (it != this->map.end());
-  f = it->second->second;
+  pthread_mutex_lock(&shard.lock);
+  auto it = shard.map.find(file_id);
+  assert (it != shard.map.end());
+  f = it->second;
 
   size_ = f->size;
   f->resize(new_size);
   this->size -= (size_ - f->size);
+  pthread_mutex_unlock(&shard.lock);
 
   Debug("<-- Exiting LRUCache resize() -->");
 
 }
+
+
+/*
+ * Function to grow a file in the cache upto new_size,
+ * the new bytes being a hole of zeros.
+ */
+void
+LRUCache::extend (const std::string & file_id,
+                  size_t new_size,
+                  struct GDFSNode * node)
+{
+
+  Debug("<-- Entering LRUCache extend() -->");
+
+  File * f = NULL;
+  size_t added_size = 0;
+
+  if (new_size <= node->entry->file_size) {
+    goto out;
+  }
+
+  f = this->get_file(file_id, node->entry->file_size, 0);
+  this->size -= f->extend(node->entry->file_size, new_size, node->entry, added_size);
+  this->add_size(added_size);
+
+out:
+  Debug("<-- Exiting LRUCache extend() -->");
+}
+
+
+/*
+ * Function to move the whole cache into the disk cache,
+ * and save its index for the next mount.
+ * Called at unmount, once the pending uploads are done.
+ */
+void
+LRUCache::save (void)
+{
+
+  Debug("<-- Entering LRUCache save() -->");
+
+  bool kept = false;
+  std::string victim;
+
+  for (unsigned i = 0; i < GDFS_CACHE_SHARDS; ++i) {
+    struct CacheShard & shard = this->shards[i];
+
+    // In the order of the policy, to keep the files
+    // most worth caching ahead in the disk cache.
+    pthread_mutex_lock(&shard.lock);
+    while (shard.policy->evict(victim)) {
+      auto it = shard.map.find(victim);
+      if (it != shard.map.end()) {
+        this->size -= it->second->evict(kept);
+      }
+    }
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  this->disk.save();
+
+  Debug("<-- Exiting LRUCache save() -->");
+}
+
+
+/*
+ * Function to hold back a write while too much of the cache
+ * is not yet saved in Google Drive. Gives up waiting after
+ * GDFS_CACHE_DIRTY_WAIT seconds, so that a failing upload does not
+ * hold up the writes for ever.
+ */
+void
+LRUCache::wait_dirty (void)
+{
+
+  Debug("<-- Entering LRUCache wait_dirty() -->");
+
+  uint64_t start = now_ms();
+  struct timespec ts;
+
+  pthread_mutex_lock(&dirty_lock);
+  ++this->dirty_stats.throttled;
+  while (this->dirty_full() &&
+         now_ms() - start < GDFS_CACHE_DIRTY_WAIT * 1000) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    pthread_cond_timedwait(&dirty_cond, &dirty_lock, &ts);
+  }
+  this->dirty_stats.throttle_ms += now_ms() - start;
+  pthread_mutex_unlock(&dirty_lock);
+
+  Debug("<-- Exiting LRUCache wait_dirty() -->");
+}
+
+
+void
+LRUCache::get_dirty_stats (struct DirtyStats & stats)
+{
+  pthread_mutex_lock(&dirty_lock);
+  stats = this->dirty_stats;
+  stats.bytes = this->dirty;
+  pthread_mutex_unlock(&dirty_lock);
+}
+
+
+/*
+ * Function to get the counters of the disk cache.
+ */
+void
+LRUCache::get_disk_stats (struct DiskCacheStats & stats)
+{
+  this->disk.get_stats(stats);
+}
+
+
+/*
+ * Function to get the counters of the reclaimer.
+ */
+void
+LRUCache::get_evict_stats (struct EvictStats & stats)
+{
+  pthread_mutex_lock(&reclaim_lock);
+  stats = this->evict_stats;
+  pthread_mutex_unlock(&reclaim_lock);
+}
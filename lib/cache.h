@@ -38,126 +38,515 @@
 #define CACHE_H__
 
 #include <string>
-#include <set>
 #include <list>
+#include <map>
+#include <vector>
+#include <atomic>
 #include <unordered_map>
 
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include <pthread.h>
 
 #include "auth.h"
+#include "conf.h"
+#include "disk_cache.h"
+#include "cache_policy.h"
+#include "slab.h"
 
 
-struct Page {
-  size_t start;
-  size_t stop;
-  size_t size;
-  char * mem;
+// Eviction policy of the cache, "tinylfu" or "lru".
+// Every access to the cache is written to the trace file, if set,
+// to be replayed later against the policies by cache_replay.
+extern std::string cache_policy;
+extern std::string cache_trace;
 
-  Page (void) :
-    start(0),
-    stop(0),
-    size(0),
-    mem(NULL) {};
+// The cache is trimmed in the background down to the low watermark
+// once it grows past the high watermark (both in percent of its size).
+extern unsigned cache_high_watermark;
+extern unsigned cache_low_watermark;
 
-  Page (char * m,
-        size_t start_,
-        size_t stop_) :
-    start(start_),
-    stop(stop_),
-    size(stop_ - start_ + 1),
-    mem(m) {};
 
-  ~Page (void)
+// Every cache block is split into sectors,
+// with one valid and one dirty bit per sector.
+#define GDFS_CACHE_SECTORS 64
+#define GDFS_CACHE_SECTOR_SIZE (GDFS_CACHE_BLOCK_SIZE / GDFS_CACHE_SECTORS)
+
+static_assert(GDFS_CACHE_BLOCK_SIZE % GDFS_CACHE_SECTORS == 0,
+              "cache block size must be a multiple of the sectors per block");
+
+static_assert(GDFS_CACHE_SECTOR_SIZE % GDFS_SLAB_MIN_SIZE == 0,
+              "cache sector size must be a multiple of the slab min size");
+
+
+// A fixed size block of a file in the cache.
+// The memory of the block grows upto GDFS_CACHE_BLOCK_SIZE,
+// as far as the file has been cached, and comes from the slab allocator.
+// A block held by the snapshot of an upload is shared (refs > 1),
+// and is copied before the file changes it.
+struct Block {
+  char * mem;
+  size_t capacity;
+  uint64_t valid;
+  uint64_t dirty;
+  unsigned refs;
+
+  Block (void) :
+    mem(NULL),
+    capacity(0),
+    valid(0),
+    dirty(0),
+    refs(1) {};
+
+  ~Block (void)
   {
-    delete[] mem;
-    size = 0;
+    slab.free(mem, capacity);
     mem = NULL;
+    capacity = 0;
   }
+
+  size_t
+  reserve (size_t len);
 };
 
 
-struct page_cmp {
-  bool
-  operator() (const Page * a,
-              const Page * b) const
-  {
-    return a->start < b->start;
-  }
+// A download of the bytes start to end of a file, in flight.
+// Once downloaded, received is the number of bytes received from start,
+// and ok whether the download succeeded.
+struct Fetch {
+  off_t start;
+  off_t end;
+  unsigned generation;
+  size_t received;
+  bool ok;
+
+  Fetch (off_t start_,
+         off_t end_,
+         unsigned generation_) :
+    start(start_),
+    end(end_),
+    generation(generation_),
+    received(0),
+    ok(false) {};
+};
+
+
+// The contents of a file as of the start of its upload.
+// Only the blocks with modified sectors are held, as the other
+// sectors are the same as in Google Drive.
+struct Snapshot {
+  size_t size;
+  unsigned generation;
+  std::vector <struct Block *> blocks;
+  std::map <size_t, size_t> holes;
 };
 
 
 struct File {
   Auth & auth;
+  DiskCache & disk;
+  std::atomic <size_t> & dirty_bytes;
+  std::string id;
   time_t mtime;
+  std::string md5;
   size_t size;
+  unsigned generation;
   pthread_mutex_t lock;
-  std::set <struct Page *, page_cmp> pages;
-
-  File (Auth & auth_) :
+  pthread_cond_t fetch_cond;
+  std::vector <struct Block *> blocks;
+  std::list <struct Fetch *> fetches;
+
+  // Runs of sectors known to be zeros, left by extending the file,
+  // with no memory behind them. Keyed by the first sector of the run,
+  // to the sector past its last one.
+  std::map <size_t, size_t> holes;
+
+  // Sequential read detection.
+  // ra_window is 0 while the reads are not sequential.
+  off_t ra_next;
+  off_t ra_issued;
+  size_t ra_window;
+
+  // Downloads running, guarded by the download slot lock.
+  unsigned running;
+
+  // End of the last read or write, to tell a new access to the file
+  // from the next chunk of the same one.
+  off_t last_end;
+
+  // Small writes not yet copied into the blocks, combined into
+  // extent_len bytes of the file from extent_offset, all within
+  // the same block. The extent is laid out like that block.
+  char * extent;
+  off_t extent_offset;
+  size_t extent_len;
+
+  // Snapshot being uploaded, if any.
+  struct Snapshot * snap;
+
+  File (Auth & auth_,
+        DiskCache & disk_,
+        std::atomic <size_t> & dirty_bytes_,
+        const std::string & id_) :
     auth(auth_),
+    disk(disk_),
+    dirty_bytes(dirty_bytes_),
+    id(id_),
     mtime(0),
-    size(0)
+    size(0),
+    generation(0),
+    ra_next(0),
+    ra_issued(0),
+    ra_window(0),
+    running(0),
+    last_end(-1),
+    extent(NULL),
+    extent_offset(0),
+    extent_len(0),
+    snap(NULL)
   {
     pthread_mutex_init(&lock, NULL);
-    this->pages.clear();
+    pthread_cond_init(&fetch_cond, NULL);
+    this->blocks.clear();
   }
 
   ~File() {
-    this->delete_pages();
+    this->release_snapshot(false);
+    this->free_blocks();
+    pthread_cond_destroy(&fetch_cond);
     pthread_mutex_destroy(&lock);
   }
 
+  size_t
+  delete_blocks (void);
+
+  size_t
+  evict (bool & kept);
+
+  bool
+  touch (off_t offset,
+         size_t len);
+
+  size_t
+  check_mtime (struct GDFSEntry * entry);
+
+  ssize_t
+  read (char * buf,
+        off_t offset,
+        size_t len,
+        struct GDFSEntry * entry,
+        size_t & added);
+
+  bool
+  write (const char * buf,
+         off_t offset,
+         size_t len,
+         struct GDFSEntry * entry,
+         size_t & added);
+
+  struct Fetch *
+  readahead (off_t offset,
+             size_t len,
+             struct GDFSEntry * entry);
+
   void
-  delete_pages (void);
+  complete (struct Fetch * fe,
+            const char * buf,
+            size_t len,
+            size_t eof,
+            size_t & added);
+
+  size_t
+  clean (void);
 
   size_t
-  get (std::list <struct Page *> & l,
-       off_t start,
-       off_t stop,
-       struct GDFSEntry * entry);
-
-  struct Page *
-  put (char * buf,
-       off_t start,
-       off_t stop,
-       struct GDFSEntry * entry);
-
-  int
-  read_file (struct GDFSEntry * entry,
-             char * buf,
-             off_t & start,
-             off_t & stop);
+  snapshot (struct GDFSEntry * entry,
+            size_t & added);
+
+  size_t
+  read_snapshot (char * buf,
+                 off_t offset,
+                 size_t len,
+                 struct GDFSEntry * entry,
+                 size_t & added);
+
+  size_t
+  release_snapshot (bool saved);
+
+  void
+  set_version (time_t mtime_,
+               const std::string & md5_);
 
   void
   resize (size_t new_size);
 
+  size_t
+  extend (size_t old_size,
+          size_t new_size,
+          struct GDFSEntry * entry,
+          size_t & added);
+
+  private:
+
+    size_t
+    free_blocks (void);
+
+    void
+    set_dirty (struct Block * b,
+               uint64_t mask);
+
+    bool
+    write_blocks (const char * buf,
+                  off_t offset,
+                  size_t len,
+                  struct GDFSEntry * entry,
+                  size_t & added);
+
+    bool
+    combine (const char * buf,
+             off_t offset,
+             size_t len,
+             struct GDFSEntry * entry,
+             size_t & added);
+
+    void
+    flush_extent (struct GDFSEntry * entry,
+                  size_t & added);
+
+    struct Block *
+    get_block (size_t index,
+               size_t len,
+               size_t & added);
+
+    struct Block *
+    own_block (size_t index,
+               size_t & added);
+
+    size_t
+    drop_block (struct Block * b,
+                size_t * kept = NULL);
+
+    struct Block *
+    saved_block (size_t sector) const;
+
+    bool
+    is_valid (size_t sector) const;
+
+    bool
+    in_hole (size_t sector) const;
+
+    void
+    cut_hole (size_t first,
+              size_t last);
+
+    void
+    cut_extent (size_t new_size);
+
+    bool
+    is_fetching (off_t offset) const;
+
+    struct Fetch *
+    begin_fetch (off_t start,
+                 off_t end);
+
+    void
+    acquire_slot (void);
+
+    void
+    release_slot (void);
+
+    void
+    download (std::vector <std::pair <struct Fetch *, char *>> & own,
+              struct GDFSEntry * entry);
+
+    void
+    end_fetch (struct Fetch * fe,
+               const char * buf,
+               size_t len,
+               size_t eof,
+               size_t & added);
+
+    void
+    load_disk (size_t first,
+               size_t last,
+               size_t & added);
+
+    bool
+    fill (off_t start,
+          off_t stop,
+          struct GDFSEntry * entry,
+          size_t & added);
+
+    size_t
+    read_file (struct GDFSEntry * entry,
+               const struct iovec * iov,
+               int iovcnt,
+               off_t start,
+               off_t stop);
+
+};
+
+
+// Counters of the data in the cache not yet saved in Google Drive.
+// throttled is the number of writes held back for the dirty data
+// to be uploaded, and throttle_ms the time they were held for.
+struct DirtyStats {
+  uint64_t bytes;
+  uint64_t peak;
+  uint64_t throttled;
+  uint64_t throttle_ms;
+};
+
+
+struct EvictStats {
+  uint64_t reclaimed;
+  uint64_t runs;
+  uint64_t reclaim_ms;
+  uint64_t stalls;
+  uint64_t stall_ms;
+};
+
+
+// A shard of the cache, with its own eviction policy.
+// Every file id always maps to the same shard.
+struct CacheShard {
+  pthread_mutex_t lock;
+  CachePolicy * policy;
+  std::unordered_map <std::string, struct File *> map;
+
+  CacheShard (void) :
+    policy(NULL)
+  {
+    pthread_mutex_init(&lock, NULL);
+  }
+
+  ~CacheShard (void)
+  {
+    for (auto & it : this->map) {
+      delete it.second;
+    }
+    this->map.clear();
+    delete this->policy;
+    pthread_mutex_destroy(&lock);
+  }
 };
 
 
 class LRUCache {
   private:
     Auth & auth;
-    size_t size;
-    std::list <std::pair <std::string, struct File *>> cache;
-    std::unordered_map <std::string, decltype(cache.begin())> map;
+    std::atomic <size_t> size;
+    unsigned evict_next;
+    pthread_mutex_t evict_lock;
+    size_t high_mark;
+    size_t low_mark;
+    bool reclaim_stop;
+    bool reclaim_running;
+    pthread_t reclaimer;
+    pthread_mutex_t reclaim_lock;
+    pthread_cond_t reclaim_cond;
+    struct EvictStats evict_stats;
+    DiskCache disk;
+    struct CacheShard shards[GDFS_CACHE_SHARDS];
+    int readaheads;
+    pthread_mutex_t readahead_lock;
+    pthread_cond_t readahead_cond;
+    FILE * trace;
+    pthread_mutex_t trace_lock;
+    std::atomic <size_t> dirty;
+    struct DirtyStats dirty_stats;
+    pthread_mutex_t dirty_lock;
+    pthread_cond_t dirty_cond;
+
+    struct CacheShard &
+    get_shard (const std::string & file_id);
+
+    void
+    start_reclaim (void);
+
+    static void *
+    reclaim (void * arg);
+
+    size_t
+    shrink (size_t target);
+
+    struct File *
+    get_file (const std::string & file_id,
+              off_t offset,
+              size_t len);
+
+    void
+    add_size (size_t added_size);
+
+    void
+    record (const std::string & file_id,
+            off_t offset,
+            size_t len);
+
+    void
+    readahead (const std::string & file_id,
+               struct File * f,
+               struct GDFSEntry * entry,
+               off_t offset,
+               size_t len);
+
+    void
+    end_readahead (void);
 
   public:
-    LRUCache (Auth & auth_) :
+    LRUCache (Auth & auth_,
+              const std::string & disk_dir) :
       auth(auth_),
-      size(0) {};
+      size(0),
+      evict_next(0),
+      high_mark(0),
+      low_mark(0),
+      reclaim_stop(false),
+      reclaim_running(false),
+      readaheads(0),
+      trace(NULL),
+      dirty(0)
+    {
+      pthread_mutex_init(&evict_lock, NULL);
+      pthread_mutex_init(&reclaim_lock, NULL);
+      pthread_cond_init(&reclaim_cond, NULL);
+      pthread_mutex_init(&trace_lock, NULL);
+      pthread_mutex_init(&dirty_lock, NULL);
+      pthread_cond_init(&dirty_cond, NULL);
+      pthread_mutex_init(&readahead_lock, NULL);
+      pthread_cond_init(&readahead_cond, NULL);
+      this->dirty_stats = DirtyStats();
+      this->evict_stats = EvictStats();
+      this->disk.open(disk_dir, disk_cache_max_size);
+      this->set_policy(cache_policy);
+      if (cache_trace.empty() == false) {
+        this->trace = fopen(cache_trace.c_str(), "a");
+      }
+      this->start_reclaim();
+    }
 
     ~LRUCache (void);
 
+    void
+    set_policy (const std::string & name);
+
     void
     free_cache (size_t size_);
 
-    size_t
+    ssize_t
     get (const std::string & file_id,
          char * buf,
          off_t offset,
          size_t len,
-         struct GDFSNode * node);
+         struct GDFSNode * node,
+         bool readahead = false);
+
+    void
+    load (const std::string & file_id,
+          off_t offset,
+          size_t len,
+          struct GDFSNode * node);
 
     bool
     put (const std::string & file_id,
@@ -179,10 +568,58 @@ class LRUCache {
     set_time (const std::string & file_id,
               time_t mtime);
 
+    void
+    set_version (const std::string & file_id,
+                 time_t mtime,
+                 const std::string & md5);
+
     void
     resize (const std::string & file_id,
             size_t new_size);
 
+    void
+    extend (const std::string & file_id,
+            size_t new_size,
+            struct GDFSNode * node);
+
+    void
+    clean (const std::string & file_id);
+
+    size_t
+    snapshot (const std::string & file_id,
+              struct GDFSNode * node);
+
+    size_t
+    get_snapshot (const std::string & file_id,
+                  char * buffer,
+                  off_t offset,
+                  size_t len,
+                  struct GDFSNode * node);
+
+    void
+    release (const std::string & file_id);
+
+    void
+    save (void);
+
+    bool
+    dirty_full (void) const
+    {
+      return this->dirty >= GDFS_CACHE_DIRTY_MAX;
+    }
+
+    void
+    wait_dirty (void);
+
+    void
+    get_dirty_stats (struct DirtyStats & stats);
+
+    void
+    get_disk_stats (struct DiskCacheStats & stats);
+
+    void
+    get_evict_stats (struct EvictStats & stats);
+
 };
 
 
@@ -0,0 +1,291 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+#include <algorithm>
+#include <functional>
+
+#include "cache_policy.h"
+
+
+// Seeds of the rows of the frequency sketch.
+static const uint64_t sketch_seeds[GDFS_SKETCH_DEPTH] = {
+  0x9e3779b97f4a7c15ULL,
+  0xc2b2ae3d27d4eb4fULL,
+  0x165667b19e3779f9ULL,
+  0xd6e8feb86659fd93ULL
+};
+
+
+CachePolicy *
+CachePolicy::create (const std::string & name_)
+{
+  if (name_ == "lru") {
+    return new LRUPolicy();
+  } else if (name_ == "tinylfu") {
+    return new TinyLFUPolicy();
+  }
+  return NULL;
+}
+
+
+
+/**********************************/
+/*              LRU               */
+/**********************************/
+
+
+void
+LRUPolicy::access (const std::string & key,
+                   bool /* counted */)
+{
+  auto it = this->map.find(key);
+  if (it == this->map.end()) {
+    this->lru.emplace_front(key);
+    this->map.emplace(key, this->lru.begin());
+  } else {
+    this->lru.splice(this->lru.begin(), this->lru, it->second);
+  }
+}
+
+
+void
+LRUPolicy::remove (const std::string & key)
+{
+  auto it = this->map.find(key);
+  if (it != this->map.end()) {
+    this->lru.erase(it->second);
+    this->map.erase(it);
+  }
+}
+
+
+bool
+LRUPolicy::evict (std::string & key)
+{
+  if (this->lru.empty()) {
+    return false;
+  }
+
+  key = this->lru.back();
+  this->map.erase(key);
+  this->lru.pop_back();
+
+  return true;
+}
+
+
+
+/**********************************/
+/*        FREQUENCY SKETCH        */
+/**********************************/
+
+
+size_t
+FrequencySketch::slot (uint64_t hash,
+                       unsigned row) const
+{
+  uint64_t h = (hash + sketch_seeds[row]) * sketch_seeds[row];
+  return row * GDFS_SKETCH_WIDTH + ((h >> 32) & (GDFS_SKETCH_WIDTH - 1));
+}
+
+
+void
+FrequencySketch::add (const std::string & key)
+{
+  uint64_t hash = std::hash <std::string>()(key);
+
+  for (unsigned i = 0; i < GDFS_SKETCH_DEPTH; ++i) {
+    uint8_t & counter = this->table[this->slot(hash, i)];
+    if (counter < 15) {
+      ++counter;
+    }
+  }
+
+  // Age all the counters.
+  if (++this->additions >= 10 * GDFS_SKETCH_WIDTH) {
+    for (auto & counter : this->table) {
+      counter >>= 1;
+    }
+    this->additions = 0;
+  }
+}
+
+
+unsigned
+FrequencySketch::estimate (const std::string & key) const
+{
+  uint64_t hash = std::hash <std::string>()(key);
+  unsigned freq = 15;
+
+  for (unsigned i = 0; i < GDFS_SKETCH_DEPTH; ++i) {
+    freq = std::min(freq, (unsigned) this->table[this->slot(hash, i)]);
+  }
+
+  return freq;
+}
+
+
+
+/**********************************/
+/*          WINDOW TINYLFU        */
+/**********************************/
+
+
+std::list <std::string> &
+TinyLFUPolicy::segment (Segment s)
+{
+  switch (s) {
+    case WINDOW:
+      return this->window;
+    case PROBATION:
+      return this->probation;
+    default:
+      return this->protect;
+  }
+}
+
+
+/*
+ * Function to move a key to the front of a segment.
+ */
+void
+TinyLFUPolicy::move (const std::string & key,
+                     Segment to)
+{
+  struct Node & node = this->map[key];
+  std::list <std::string> & dst = this->segment(to);
+
+  dst.splice(dst.begin(), this->segment(node.segment), node.pos);
+  node.segment = to;
+  node.pos = dst.begin();
+}
+
+
+void
+TinyLFUPolicy::drop (const std::string & key,
+                     std::string & evicted)
+{
+  evicted = key;
+  this->remove(evicted);
+}
+
+
+void
+TinyLFUPolicy::access (const std::string & key,
+                       bool counted)
+{
+  if (counted) {
+    this->sketch.add(key);
+  }
+
+  auto it = this->map.find(key);
+  if (it == this->map.end()) {
+    this->window.emplace_front(key);
+    this->map[key] = { WINDOW, this->window.begin() };
+
+    // The window holds 1% of the keys.
+    // The oldest key in it goes on probation.
+    if (this->window.size() > std::max((size_t) 1, this->map.size() / 100)) {
+      this->move(this->window.back(), PROBATION);
+    }
+    return;
+  }
+
+  switch (it->second.segment) {
+    case WINDOW:
+      this->move(key, WINDOW);
+      break;
+
+    case PROBATION:
+      if (counted == false) {
+        this->move(key, PROBATION);
+        break;
+      }
+
+      // Used again. Protect it, within 80% of the main area.
+      this->move(key, PROTECTED);
+      while (this->protect.size() * 5 > (this->protect.size() + this->probation.size()) * 4) {
+        this->move(this->protect.back(), PROBATION);
+      }
+      break;
+
+    case PROTECTED:
+      this->move(key, PROTECTED);
+      break;
+  }
+}
+
+
+void
+TinyLFUPolicy::remove (const std::string & key)
+{
+  auto it = this->map.find(key);
+  if (it != this->map.end()) {
+    this->segment(it->second.segment).erase(it->second.pos);
+    this->map.erase(it);
+  }
+}
+
+
+/*
+ * Function to pick the key to evict.
+ * The newest key on probation pushes out the oldest one,
+ * unless the oldest one is used more often.
+ */
+bool
+TinyLFUPolicy::evict (std::string & key)
+{
+  if (this->probation.size() > 1) {
+    const std::string & candidate = this->probation.front();
+    const std::string & victim = this->probation.back();
+    if (this->sketch.estimate(candidate) >= this->sketch.estimate(victim)) {
+      this->drop(victim, key);
+    } else {
+      this->drop(candidate, key);
+    }
+  } else if (this->probation.empty() == false) {
+    this->drop(this->probation.back(), key);
+  } else if (this->protect.empty() == false) {
+    this->drop(this->protect.back(), key);
+  } else if (this->window.empty() == false) {
+    this->drop(this->window.back(), key);
+  } else {
+    return false;
+  }
+
+  return true;
+}
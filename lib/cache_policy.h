@@ -0,0 +1,198 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+#ifndef CACHE_POLICY_H__
+#define CACHE_POLICY_H__
+
+
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+#include <stdint.h>
+
+
+/***********************************************/
+/*           CACHE EVICTION POLICIES           */
+/*                                             */
+/***********************************************/
+
+
+// Width of the frequency sketch of W-TinyLFU, per shard.
+#define GDFS_SKETCH_WIDTH 1024
+#define GDFS_SKETCH_DEPTH 4
+
+
+/*
+ * Decides which file of a cache shard is evicted next.
+ * Keys are file ids. A key is resident from its first access
+ * until it is evicted or removed.
+ * A policy is not thread safe. It is guarded by the shard lock.
+ */
+class CachePolicy {
+  public:
+    virtual
+    ~CachePolicy (void) {};
+
+    // counted is false if the access only continues
+    // the previous one, like the next chunk of a sequential read.
+    virtual void
+    access (const std::string & key,
+            bool counted) = 0;
+
+    virtual void
+    remove (const std::string & key) = 0;
+
+    // Picks the next key to evict, and drops it.
+    // Returns false if no key is resident.
+    virtual bool
+    evict (std::string & key) = 0;
+
+    virtual const char *
+    name (void) const = 0;
+
+    static CachePolicy *
+    create (const std::string & name_);
+};
+
+
+// Least Recently Used.
+class LRUPolicy : public CachePolicy {
+  private:
+    std::list <std::string> lru;
+    std::unordered_map <std::string, std::list <std::string>::iterator> map;
+
+  public:
+    void
+    access (const std::string & key,
+            bool counted);
+
+    void
+    remove (const std::string & key);
+
+    bool
+    evict (std::string & key);
+
+    const char *
+    name (void) const
+    {
+      return "lru";
+    }
+};
+
+
+// Count-min sketch of the access frequency of keys,
+// with 4 bit counters that are halved every 10 * width accesses,
+// so that old popularity fades away.
+class FrequencySketch {
+  private:
+    std::vector <uint8_t> table;
+    uint32_t additions;
+
+    size_t
+    slot (uint64_t hash,
+          unsigned row) const;
+
+  public:
+    FrequencySketch (void) :
+      table(GDFS_SKETCH_WIDTH * GDFS_SKETCH_DEPTH, 0),
+      additions(0) {};
+
+    void
+    add (const std::string & key);
+
+    unsigned
+    estimate (const std::string & key) const;
+};
+
+
+/*
+ * Window TinyLFU.
+ * New keys enter a small LRU window, and then go on probation.
+ * Keys accessed again on probation move to the protected segment.
+ * The oldest key on probation is evicted first, unless it is used
+ * more often than the newest one.
+ * So a one time scan over lots of files passes through probation,
+ * without pushing out the files in use.
+ */
+class TinyLFUPolicy : public CachePolicy {
+  private:
+    enum Segment { WINDOW, PROBATION, PROTECTED };
+
+    struct Node {
+      Segment segment;
+      std::list <std::string>::iterator pos;
+    };
+
+    FrequencySketch sketch;
+    std::list <std::string> window;
+    std::list <std::string> probation;
+    std::list <std::string> protect;
+    std::unordered_map <std::string, struct Node> map;
+
+    std::list <std::string> &
+    segment (Segment s);
+
+    void
+    move (const std::string & key,
+          Segment to);
+
+    void
+    drop (const std::string & key,
+          std::string & evicted);
+
+  public:
+    void
+    access (const std::string & key,
+            bool counted);
+
+    void
+    remove (const std::string & key);
+
+    bool
+    evict (std::string & key);
+
+    const char *
+    name (void) const
+    {
+      return "tinylfu";
+    }
+};
+
+
+#endif // CACHE_POLICY_H__
@@ -38,6 +38,8 @@
 #include <regex>
 
 #include <string.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "dir_tree.h"
 #include "common.h"
@@ -171,3 +173,36 @@ rand_str (void)
 
   return s;
 }
+
+
+/*
+ * Function to check whether a response header line is a
+ * "200 OK" status line, of any HTTP version (HTTP/1.1 or HTTP/2).
+ */
+bool
+is_status_ok (const std::string & line)
+{
+  int code = 0;
+
+  if (line.compare(0, 5, "HTTP/") != 0) {
+    return false;
+  }
+  if (sscanf(line.c_str(), "HTTP/%*s %d", &code) != 1) {
+    return false;
+  }
+
+  return (code == 200);
+}
+
+
+/*
+ * Monotonic clock, in milliseconds.
+ */
+uint64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
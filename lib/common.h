@@ -41,6 +41,7 @@
 
 #include <string>
 
+#include <stdint.h>
 #include <time.h>
 
 
@@ -68,5 +69,11 @@ remove_name_conflict (std::string & file_name,
 std::string
 rand_str (void);
 
+bool
+is_status_ok (const std::string & line);
+
+uint64_t
+now_ms (void);
+
 
 #endif // COMMON_H__
@@ -52,10 +52,36 @@
 #define GDFS_BLOCK_SIZE 4096
 #define GDFS_FRAGMENT_SIZE 4096
 
-#define GDFS_MAX_WORKER_THREADS 10
+#define GDFS_MAX_INFLIGHT_REQUESTS 256
+#define GDFS_RETRY_DELAY 1000
+#define GDFS_LOW_SPEED_LIMIT 1024
+#define GDFS_LOW_SPEED_TIME 60
+#define GDFS_MAX_HOST_CONNECTIONS 4
+#define GDFS_MAX_CONCURRENT_STREAMS 100
+#define GDFS_BATCH_MAX_REQUESTS 100
 #define GDFS_CACHE_MAX_SIZE 104857600
 #define GDFS_CACHE_TIMEOUT 60
+#define GDFS_CACHE_SHARDS 16
+#define GDFS_CACHE_DIRTY_MAX (GDFS_CACHE_MAX_SIZE / 2)
+#define GDFS_CACHE_DIRTY_WAIT 30
+#define GDFS_CACHE_HIGH_WATERMARK 90
+#define GDFS_CACHE_LOW_WATERMARK 80
+#define GDFS_CACHE_BLOCK_SIZE 262144
+#define GDFS_SLAB_REGION_SIZE 33554432
+#define GDFS_READAHEAD_MIN 262144
+#define GDFS_READAHEAD_MAX 33554432
+#define GDFS_FETCH_MERGE_GAP 65536
+#define GDFS_FETCH_SEGMENT_SIZE 4194304
+#define GDFS_FETCH_FILE_PARALLEL 4
+#define GDFS_FETCH_MAX_PARALLEL 16
+#define GDFS_DISK_CACHE_MAX_SIZE 1073741824
 #define GDFS_UPLOAD_CHUNK_SIZE 10485760
+#define GDFS_UPLOAD_BUFFER_SIZE 524288
+#define GDFS_MULTIPART_MAX_SIZE 5242880
+#define GDFS_WRITEBACK_THREADS 4
+#define GDFS_WRITEBACK_QUIET_PERIOD 5
+#define GDFS_WRITEBACK_MAX_STALENESS 30
+#define GDFS_WRITEBACK_MAX_RETRIES 5
 
 #define GDFS_CLIENT_ID "1226761120-i6c1c1l3aafea2je44ubq3d9g19k48ob.apps.googleusercontent.com"
 #define GDFS_CLIENT_SECRET "60wF05CehSS2RmSToMyAzA-N"
@@ -73,6 +99,8 @@
 #define GDFS_FILE_URL_ "https://www.googleapis.com/drive/v3/files"
 #define GDFS_ABOUT_URL "https://www.googleapis.com/drive/v3/about"
 #define GDFS_UPLOAD_URL "https://www.googleapis.com/upload/drive/v3/files/"
+#define GDFS_UPLOAD_URL_ "https://www.googleapis.com/upload/drive/v3/files"
+#define GDFS_BATCH_URL "https://www.googleapis.com/batch/drive/v3"
 
 #define GDFS_AUTH_FILE "gdfs.auth"
 #define GDFS_CONF_FILE "gdfs.conf"
@@ -72,6 +72,7 @@ struct GDFSEntry {
   bool is_dir;
   int ref_count;
   std::string mime_type;
+  std::string md5;
   bool g_doc;
   bool dirty;
   bool pending_create;
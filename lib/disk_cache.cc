@@ -0,0 +1,741 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <iterator>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "disk_cache.h"
+#include "cache.h"
+#include "log.h"
+
+
+std::string disk_cache_dir = "";
+uint64_t disk_cache_max_size = GDFS_DISK_CACHE_MAX_SIZE;
+
+
+DiskCache::DiskCache (void) :
+  max_size(0),
+  size(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  this->stats = DiskCacheStats();
+}
+
+
+// The files are left in place for the next mount,
+// in case the index has been saved.
+DiskCache::~DiskCache (void)
+{
+  for (auto & it : this->files) {
+    if (it.second.fd >= 0) {
+      close(it.second.fd);
+    }
+  }
+  pthread_mutex_destroy(&lock);
+}
+
+
+/*
+ * Function to set up the disk cache in the GDFS_DISK_CACHE_DIR
+ * directory under dir_, so that no file of dir_ itself is touched.
+ * The files in the index saved by the last mount are taken back,
+ * and anything else left in that directory is removed.
+ */
+void
+DiskCache::open (const std::string & dir_,
+                 uint64_t max_size_)
+{
+
+  Debug("<-- Entering DiskCache open() -->");
+
+  DIR * d = NULL;
+  struct dirent * de = NULL;
+
+  this->dir = dir_;
+  if (this->dir.empty() == false && this->dir.back() != '/') {
+    this->dir += "/";
+  }
+  this->max_size = max_size_;
+  if (this->max_size == 0) {
+    goto out;
+  }
+
+  if (mkdir(this->dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+    Error("disk cache: unable to create %s: %s", this->dir.c_str(), strerror(errno));
+    this->max_size = 0;
+    goto out;
+  }
+
+  this->dir += GDFS_DISK_CACHE_DIR;
+  if (mkdir(this->dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+    Error("disk cache: unable to create %s: %s", this->dir.c_str(), strerror(errno));
+    this->max_size = 0;
+    goto out;
+  }
+
+  this->load_index();
+
+  d = opendir(this->dir.c_str());
+  if (d == NULL) {
+    Error("disk cache: unable to open %s: %s", this->dir.c_str(), strerror(errno));
+    this->max_size = 0;
+    goto out;
+  }
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] != '.' && this->files.find(de->d_name) == this->files.end()) {
+      unlinkat(dirfd(d), de->d_name, 0);
+    }
+  }
+  closedir(d);
+  unlink((this->dir + GDFS_DISK_CACHE_INDEX ".tmp").c_str());
+
+  // The size of the cache may have been lowered since.
+  this->make_room(0, "");
+
+  Info("disk cache: %s, upto %llu bytes, %llu bytes from the last mount",
+       this->dir.c_str(), (unsigned long long) this->max_size, (unsigned long long) this->size);
+
+out:
+  Debug("<-- Exiting DiskCache open() -->");
+}
+
+
+/*
+ * Function to read the index saved by the last mount.
+ * The index is removed right away, as the files are not
+ * in sync with it anymore once they are written to.
+ * The data files themselves are opened on first use.
+ */
+void
+DiskCache::load_index (void)
+{
+
+  Debug("<-- Entering DiskCache load_index() -->");
+
+  std::string path = this->dir + GDFS_DISK_CACHE_INDEX;
+  std::ifstream in(path.c_str());
+  std::string line;
+  std::string header;
+  std::string file_id;
+  std::string md5;
+  std::vector <std::pair <std::string, struct DiskFile>> loaded;
+  struct stat st;
+  long long version;
+  size_t count = 0;
+  size_t nblocks;
+  size_t index;
+  uint64_t mask;
+  bool complete = false;
+  char colon;
+
+  if (in.is_open() == false) {
+    goto out;
+  }
+  unlink(path.c_str());
+
+  if (!std::getline(in, header) || header != GDFS_DISK_CACHE_INDEX_MAGIC) {
+    Error("disk cache: ignoring the index of an unknown format");
+    goto out;
+  }
+
+  // Every line holds a file, the most recently used first:
+  // <file id> <version> <md5 or -> <blocks> {<index>:<sector mask>}
+  // The index ends with the number of files in it.
+  while (std::getline(in, line)) {
+    std::istringstream ls(line);
+    struct DiskFile df;
+
+    ls >> file_id;
+    if (file_id == "end") {
+      complete = (ls >> count) && count == loaded.size();
+      break;
+    }
+
+    if (!(ls >> version >> md5 >> nblocks)) {
+      break;
+    }
+    df.fd = -1;
+    df.version = (time_t) version;
+    df.md5 = (md5 == "-") ? "" : md5;
+    df.size = 0;
+    for (size_t i = 0; i < nblocks; ++i) {
+      if (!(ls >> index >> colon >> std::hex >> mask >> std::dec) || colon != ':') {
+        break;
+      }
+      df.blocks[index] = mask;
+      df.size += __builtin_popcountll(mask) * GDFS_CACHE_SECTOR_SIZE;
+    }
+    if (df.blocks.size() != nblocks) {
+      break;
+    }
+    loaded.emplace_back(file_id, df);
+  }
+
+  // A torn index is ignored as a whole.
+  if (complete == false) {
+    Error("disk cache: ignoring an incomplete index");
+    goto out;
+  }
+
+  for (auto & it : loaded) {
+    if (stat((this->dir + it.first).c_str(), &st) != 0) {
+      continue;
+    }
+    this->lru.emplace_back(it.first);
+    it.second.lru = std::prev(this->lru.end());
+    this->size += it.second.size;
+    this->files.emplace(it.first, it.second);
+  }
+
+out:
+  Debug("<-- Exiting DiskCache load_index() -->");
+}
+
+
+/*
+ * Function to save the index of the disk cache,
+ * for the next mount to take back the files.
+ * The index is written to a temporary file first and renamed,
+ * after the data files are synced to disk.
+ */
+void
+DiskCache::save (void)
+{
+
+  Debug("<-- Entering DiskCache save() -->");
+
+  std::string path = this->dir + GDFS_DISK_CACHE_INDEX;
+  std::string tmp = path + ".tmp";
+  std::ostringstream out;
+  std::string data;
+  int fd = -1;
+  int dfd = -1;
+  size_t count = 0;
+
+  pthread_mutex_lock(&lock);
+
+  if (this->enabled() == false) {
+    goto out;
+  }
+
+  out << GDFS_DISK_CACHE_INDEX_MAGIC << "\n";
+  for (auto & file_id : this->lru) {
+    struct DiskFile & df = this->files[file_id];
+    if (df.fd >= 0 && fdatasync(df.fd) != 0) {
+      continue;
+    }
+    out << file_id << " " << (long long) df.version << " "
+        << (df.md5.empty() ? "-" : df.md5) << " " << df.blocks.size();
+    for (auto & b : df.blocks) {
+      out << " " << b.first << ":" << std::hex << b.second << std::dec;
+    }
+    out << "\n";
+    ++count;
+  }
+  out << "end " << count << "\n";
+  data = out.str();
+
+  fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    Error("disk cache: unable to create %s: %s", tmp.c_str(), strerror(errno));
+    goto out;
+  }
+  if (write(fd, data.c_str(), data.size()) != (ssize_t) data.size() || fsync(fd) != 0) {
+    Error("disk cache: unable to write %s: %s", tmp.c_str(), strerror(errno));
+    close(fd);
+    unlink(tmp.c_str());
+    goto out;
+  }
+  close(fd);
+
+  if (::rename(tmp.c_str(), path.c_str()) != 0) {
+    Error("disk cache: unable to save the index: %s", strerror(errno));
+    unlink(tmp.c_str());
+    goto out;
+  }
+
+  // Make the rename itself durable.
+  dfd = ::open(this->dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dfd >= 0) {
+    fsync(dfd);
+    close(dfd);
+  }
+
+  Info("disk cache: saved the index of %zu files, %llu bytes", count, (unsigned long long) this->size);
+
+out:
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting DiskCache save() -->");
+}
+
+
+/*
+ * Function to open the data file of a file in the disk cache,
+ * if not open yet. A file that cannot be opened is dropped.
+ * The disk cache lock must be held.
+ */
+bool
+DiskCache::open_file (struct DiskFile * df,
+                      const std::string & file_id)
+{
+
+  if (df->fd >= 0) {
+    return true;
+  }
+
+  df->fd = ::open((this->dir + file_id).c_str(), O_RDWR);
+  if (df->fd < 0) {
+    Error("disk cache: unable to open %s: %s", file_id.c_str(), strerror(errno));
+    this->drop_file(file_id);
+    return false;
+  }
+
+  return true;
+}
+
+
+/*
+ * Function to check a file in the disk cache against its
+ * metadata from Google Drive, once the file is first seen.
+ * A file of another version or checksum is dropped.
+ */
+void
+DiskCache::validate (const std::string & file_id,
+                     time_t version,
+                     const std::string & md5)
+{
+
+  struct DiskFile * df = NULL;
+
+  pthread_mutex_lock(&lock);
+
+  df = this->find(file_id, version);
+  if (df != NULL) {
+    if (df->md5.empty()) {
+      df->md5 = md5;
+    } else if (md5.empty() == false && df->md5 != md5) {
+      this->drop_file(file_id);
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Function to move a file to the version it is saved as
+ * in Google Drive, once uploaded from the cache.
+ */
+void
+DiskCache::set_version (const std::string & file_id,
+                        time_t version,
+                        time_t new_version,
+                        const std::string & md5)
+{
+
+  struct DiskFile * df = NULL;
+
+  pthread_mutex_lock(&lock);
+
+  df = this->find(file_id, version);
+  if (df != NULL) {
+    df->version = new_version;
+    df->md5 = md5;
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Function to find a file in the disk cache.
+ * A file of another version is dropped.
+ * The disk cache lock must be held.
+ */
+struct DiskFile *
+DiskCache::find (const std::string & file_id,
+                 time_t version)
+{
+
+  auto it = this->files.find(file_id);
+  if (it == this->files.end()) {
+    return NULL;
+  }
+
+  if (it->second.version != version) {
+    this->drop_file(file_id);
+    return NULL;
+  }
+
+  return &it->second;
+}
+
+
+/*
+ * Function to remove a file from the disk cache.
+ * The disk cache lock must be held.
+ */
+void
+DiskCache::drop_file (const std::string & file_id)
+{
+
+  auto it = this->files.find(file_id);
+  if (it == this->files.end()) {
+    return;
+  }
+
+  if (it->second.fd >= 0) {
+    close(it->second.fd);
+  }
+  unlink((this->dir + file_id).c_str());
+  this->size -= it->second.size;
+  this->stats.evicted += it->second.size;
+  this->lru.erase(it->second.lru);
+  this->files.erase(it);
+}
+
+
+/*
+ * Function to make sure that there is atleast len bytes free
+ * in the disk cache, dropping the Least Recently Used files
+ * other than file_id.
+ * The disk cache lock must be held.
+ */
+void
+DiskCache::make_room (uint64_t len,
+                      const std::string & file_id)
+{
+
+  // Walk up from the tail. Dropping the file just before it
+  // leaves the iterator valid.
+  auto it = this->lru.end();
+  std::string victim;
+
+  while (this->size + len > this->max_size &&
+         it != this->lru.begin()) {
+    victim = *std::prev(it);
+    if (victim == file_id) {
+      --it;
+      continue;
+    }
+    this->drop_file(victim);
+  }
+}
+
+
+/*
+ * Function to store the sectors in mask of block index of a file,
+ * from the memory of the block.
+ */
+void
+DiskCache::store (const std::string & file_id,
+                  time_t version,
+                  const std::string & md5,
+                  size_t index,
+                  uint64_t mask,
+                  const char * mem)
+{
+
+  Debug("<-- Entering DiskCache store() -->");
+
+  int fd = -1;
+  uint64_t * held = NULL;
+  struct DiskFile * df = NULL;
+  size_t first;
+  size_t last;
+  off_t base = (off_t) index * GDFS_CACHE_BLOCK_SIZE;
+
+  pthread_mutex_lock(&lock);
+
+  if (this->enabled() == false) {
+    goto out;
+  }
+
+  df = this->find(file_id, version);
+  if (df != NULL) {
+    if (this->open_file(df, file_id) == false) {
+      goto out;
+    }
+    mask &= ~df->blocks[index];
+  }
+  if (mask == 0) {
+    goto out;
+  }
+
+  this->make_room(__builtin_popcountll(mask) * GDFS_CACHE_SECTOR_SIZE, file_id);
+  if (this->size + __builtin_popcountll(mask) * GDFS_CACHE_SECTOR_SIZE > this->max_size) {
+    goto out;
+  }
+
+  if (df == NULL) {
+    fd = ::open((this->dir + file_id).c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+      Error("disk cache: unable to create %s: %s", file_id.c_str(), strerror(errno));
+      goto out;
+    }
+    this->lru.emplace_front(file_id);
+    df = &this->files[file_id];
+    df->fd = fd;
+    df->version = version;
+    df->md5 = md5;
+    df->size = 0;
+    df->lru = this->lru.begin();
+  } else {
+    this->lru.splice(this->lru.begin(), this->lru, df->lru);
+  }
+  held = &df->blocks[index];
+
+  // Write every run of sectors at its offset in the file.
+  for (first = 0; first < GDFS_CACHE_SECTORS; first = last) {
+    if ((mask & (1ULL << first)) == 0) {
+      last = first + 1;
+      continue;
+    }
+    for (last = first; last < GDFS_CACHE_SECTORS && (mask & (1ULL << last)); ++last);
+
+    if (pwrite(df->fd, mem + first * GDFS_CACHE_SECTOR_SIZE, (last - first) * GDFS_CACHE_SECTOR_SIZE,
+               base + first * GDFS_CACHE_SECTOR_SIZE) != (ssize_t) ((last - first) * GDFS_CACHE_SECTOR_SIZE)) {
+      Error("disk cache: unable to write %s: %s", file_id.c_str(), strerror(errno));
+      break;
+    }
+    for (size_t i = first; i < last; ++i) {
+      *held |= (1ULL << i);
+    }
+    df->size += (last - first) * GDFS_CACHE_SECTOR_SIZE;
+    this->size += (last - first) * GDFS_CACHE_SECTOR_SIZE;
+    this->stats.stored += (last - first) * GDFS_CACHE_SECTOR_SIZE;
+  }
+
+out:
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting DiskCache store() -->");
+}
+
+
+/*
+ * Function to find the sectors of block index of a file
+ * held in the disk cache.
+ */
+uint64_t
+DiskCache::lookup (const std::string & file_id,
+                   time_t version,
+                   size_t index)
+{
+
+  uint64_t mask = 0;
+  struct DiskFile * df = NULL;
+
+  pthread_mutex_lock(&lock);
+  if (this->enabled()) {
+    df = this->find(file_id, version);
+    if (df != NULL) {
+      auto it = df->blocks.find(index);
+      if (it != df->blocks.end()) {
+        mask = it->second;
+      }
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return mask;
+}
+
+
+/*
+ * Function to read the sectors in mask of block index of a file
+ * into the memory of the block.
+ * Returns the mask of the sectors read.
+ */
+uint64_t
+DiskCache::load (const std::string & file_id,
+                 time_t version,
+                 size_t index,
+                 uint64_t mask,
+                 char * mem)
+{
+
+  Debug("<-- Entering DiskCache load() -->");
+
+  uint64_t loaded = 0;
+  struct DiskFile * df = NULL;
+  size_t first;
+  size_t last;
+  off_t base = (off_t) index * GDFS_CACHE_BLOCK_SIZE;
+
+  pthread_mutex_lock(&lock);
+
+  if (this->enabled() == false) {
+    goto out;
+  }
+  df = this->find(file_id, version);
+  if (df == NULL || this->open_file(df, file_id) == false) {
+    goto out;
+  }
+  mask &= df->blocks[index];
+  this->lru.splice(this->lru.begin(), this->lru, df->lru);
+
+  for (first = 0; first < GDFS_CACHE_SECTORS; first = last) {
+    if ((mask & (1ULL << first)) == 0) {
+      last = first + 1;
+      continue;
+    }
+    for (last = first; last < GDFS_CACHE_SECTORS && (mask & (1ULL << last)); ++last);
+
+    if (pread(df->fd, mem + first * GDFS_CACHE_SECTOR_SIZE, (last - first) * GDFS_CACHE_SECTOR_SIZE,
+              base + first * GDFS_CACHE_SECTOR_SIZE) != (ssize_t) ((last - first) * GDFS_CACHE_SECTOR_SIZE)) {
+      Error("disk cache: unable to read %s: %s", file_id.c_str(), strerror(errno));
+      continue;
+    }
+    for (size_t i = first; i < last; ++i) {
+      loaded |= (1ULL << i);
+    }
+    this->stats.hits += (last - first) * GDFS_CACHE_SECTOR_SIZE;
+  }
+
+out:
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting DiskCache load() -->");
+  return loaded;
+}
+
+
+/*
+ * Function to drop the sectors covering the bytes start to stop
+ * of a file, once they are modified in memory.
+ * The rest of the file stays, as of the new version.
+ */
+void
+DiskCache::invalidate (const std::string & file_id,
+                       time_t version,
+                       time_t new_version,
+                       off_t start,
+                       off_t stop)
+{
+
+  size_t sector;
+  size_t bytes = 0;
+  struct DiskFile * df = NULL;
+
+  pthread_mutex_lock(&lock);
+
+  df = this->find(file_id, version);
+  if (df == NULL || this->open_file(df, file_id) == false) {
+    goto out;
+  }
+
+  for (sector = start / GDFS_CACHE_SECTOR_SIZE; sector <= (size_t) stop / GDFS_CACHE_SECTOR_SIZE; ++sector) {
+    auto b = df->blocks.find(sector / GDFS_CACHE_SECTORS);
+    if (b != df->blocks.end() &&
+        (b->second & (1ULL << (sector % GDFS_CACHE_SECTORS)))) {
+      b->second &= ~(1ULL << (sector % GDFS_CACHE_SECTORS));
+      bytes += GDFS_CACHE_SECTOR_SIZE;
+    }
+  }
+  df->version = new_version;
+  df->md5.clear();
+
+  // Give the space back to the file system.
+  if (bytes > 0) {
+    fallocate(df->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              start / GDFS_CACHE_SECTOR_SIZE * GDFS_CACHE_SECTOR_SIZE,
+              (stop / GDFS_CACHE_SECTOR_SIZE - start / GDFS_CACHE_SECTOR_SIZE + 1) * GDFS_CACHE_SECTOR_SIZE);
+    df->size -= bytes;
+    this->size -= bytes;
+  }
+
+out:
+  pthread_mutex_unlock(&lock);
+}
+
+
+void
+DiskCache::drop (const std::string & file_id)
+{
+  pthread_mutex_lock(&lock);
+  this->drop_file(file_id);
+  pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Function to move a file in the disk cache to a new file id.
+ */
+void
+DiskCache::rename (const std::string & file_id,
+                   const std::string & new_file_id)
+{
+
+  pthread_mutex_lock(&lock);
+
+  this->drop_file(new_file_id);
+
+  auto it = this->files.find(file_id);
+  if (it != this->files.end()) {
+    if (::rename((this->dir + file_id).c_str(), (this->dir + new_file_id).c_str()) == 0) {
+      *it->second.lru = new_file_id;
+      this->files.emplace(new_file_id, it->second);
+      this->files.erase(it);
+    } else {
+      this->drop_file(file_id);
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+
+void
+DiskCache::get_stats (struct DiskCacheStats & stats_)
+{
+  pthread_mutex_lock(&lock);
+  stats_ = this->stats;
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,202 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+#ifndef DISK_CACHE_H__
+#define DISK_CACHE_H__
+
+
+#include <string>
+#include <list>
+#include <unordered_map>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "conf.h"
+
+
+/***********************************************/
+/*             DISK CACHE (2ND TIER)           */
+/*                                             */
+/***********************************************/
+
+
+// Directory of the disk cache, under the directory it is given.
+// GDFS owns everything in it.
+#define GDFS_DISK_CACHE_DIR "gdfs_cache/"
+
+// Index of the disk cache, saved at unmount.
+#define GDFS_DISK_CACHE_INDEX ".index"
+#define GDFS_DISK_CACHE_INDEX_MAGIC "GDFS disk cache 1"
+
+
+// Directory and size (in bytes) of the disk cache.
+// An empty directory is the GDFS directory, and a size of 0
+// turns the disk cache off.
+extern std::string disk_cache_dir;
+extern uint64_t disk_cache_max_size;
+
+
+// A file in the disk cache.
+// Its sectors are kept at their own offsets in a sparse file,
+// and blocks maps a block index to the mask of its sectors held.
+// version is the modified time of the file the sectors belong to,
+// and md5 its checksum in Google Drive, if known.
+// fd is -1 until the file is first used after a mount.
+struct DiskFile {
+  int fd;
+  time_t version;
+  std::string md5;
+  uint64_t size;
+  std::unordered_map <size_t, uint64_t> blocks;
+  std::list <std::string>::iterator lru;
+};
+
+
+// Counters of the disk cache, in bytes.
+struct DiskCacheStats {
+  uint64_t hits;
+  uint64_t stored;
+  uint64_t evicted;
+};
+
+
+// Second tier of the file cache, for the blocks evicted from memory.
+// Only clean sectors are stored, and every file is dropped as a whole
+// once its version changes or the cache is out of space.
+//
+// The index of the cache is saved at unmount, and taken back at the
+// next mount. The index is removed as soon as it is read, so after
+// a crash the cache starts empty instead of trusting stale sectors.
+class DiskCache {
+  private:
+    std::string dir;
+    uint64_t max_size;
+    uint64_t size;
+    pthread_mutex_t lock;
+    std::list <std::string> lru;
+    std::unordered_map <std::string, struct DiskFile> files;
+    struct DiskCacheStats stats;
+
+    struct DiskFile *
+    find (const std::string & file_id,
+          time_t version);
+
+    bool
+    open_file (struct DiskFile * df,
+               const std::string & file_id);
+
+    void
+    drop_file (const std::string & file_id);
+
+    void
+    load_index (void);
+
+    void
+    make_room (uint64_t len,
+               const std::string & file_id);
+
+  public:
+    DiskCache (void);
+
+    ~DiskCache (void);
+
+    void
+    open (const std::string & dir_,
+          uint64_t max_size_);
+
+    bool
+    enabled (void) const
+    {
+      return this->max_size > 0;
+    }
+
+    void
+    validate (const std::string & file_id,
+              time_t version,
+              const std::string & md5);
+
+    void
+    store (const std::string & file_id,
+           time_t version,
+           const std::string & md5,
+           size_t index,
+           uint64_t mask,
+           const char * mem);
+
+    uint64_t
+    lookup (const std::string & file_id,
+            time_t version,
+            size_t index);
+
+    uint64_t
+    load (const std::string & file_id,
+          time_t version,
+          size_t index,
+          uint64_t mask,
+          char * mem);
+
+    void
+    invalidate (const std::string & file_id,
+                time_t version,
+                time_t new_version,
+                off_t start,
+                off_t stop);
+
+    void
+    set_version (const std::string & file_id,
+                 time_t version,
+                 time_t new_version,
+                 const std::string & md5);
+
+    void
+    drop (const std::string & file_id);
+
+    void
+    rename (const std::string & file_id,
+            const std::string & new_file_id);
+
+    void
+    save (void);
+
+    void
+    get_stats (struct DiskCacheStats & stats_);
+};
+
+
+#endif // DISK_CACHE_H__
@@ -41,6 +41,7 @@
 #include <sstream>
 
 #include <unistd.h>
+#include <strings.h>
 #include <assert.h>
 
 #include "json.h"
@@ -305,8 +306,226 @@ out:
 }
 
 
+// Loads the next chunk of an upload into the cache,
+// while the current chunk is being sent.
+struct Prefetch {
+  GDrive * gdi;
+  struct GDFSNode * node;
+  off_t offset;
+  size_t len;
+  bool running;
+  pthread_t thread;
+
+  Prefetch (GDrive * gdi_,
+            struct GDFSNode * node_) :
+    gdi(gdi_),
+    node(node_),
+    offset(0),
+    len(0),
+    running(false) {};
+};
+
+
+static void *
+prefetch_chunk (void * arg)
+{
+
+  struct Prefetch * p = (struct Prefetch *) arg;
+
+  try {
+    p->gdi->cache.load(p->node->entry->file_id, p->offset, p->len, p->node);
+  } catch (GDFSException & err) {
+    // The upload shall load the range by itself.
+  }
+
+  return NULL;
+}
+
+
+static void
+start_prefetch (struct Prefetch & p,
+                off_t offset,
+                size_t len)
+{
+  p.offset = offset;
+  p.len = len;
+  p.running = (pthread_create(&p.thread, NULL, prefetch_chunk, &p) == 0);
+}
+
+
+// Returns the time spent waiting for the prefetch, in ms.
+static uint64_t
+finish_prefetch (struct Prefetch & p)
+{
+  uint64_t begin = now_ms();
+
+  if (p.running) {
+    pthread_join(p.thread, NULL);
+    p.running = false;
+  }
+
+  return now_ms() - begin;
+}
+
+
+/*
+ * Function to upload a small file to Google Drive in a single
+ * multipart request (metadata and contents together).
+ * If the file is yet to be created in Google Drive and its INSERT
+ * request is still waiting in the request queue, the file is created
+ * by this request itself, and the INSERT request is dropped.
+ * A failed upload is not retried here, instead the write-back
+ * queues the file again after GDFS_RETRY_DELAY.
+ */
 void
-GDrive::write_file (struct GDFSNode * node)
+GDrive::write_file_multipart (struct GDFSNode * node,
+                              size_t size)
+{
+
+  Debug("<-- Entering write_file_multipart() -->");
+
+  json::Value val;
+  bool created = false;
+  struct req_item item;
+  struct GDFSEntry * entry = node->entry;
+  requestType type = MULTIPART_UPDATE;
+  std::string url = GDFS_UPLOAD_URL + entry->file_id + "?uploadType=multipart&fields=modifiedTime%2Cmd5Checksum";
+  std::string boundary = "gdfs_" + rand_str();
+  std::string mime_type = entry->mime_type.empty() ? "application/octet-stream" : entry->mime_type;
+  std::string query;
+  std::string head;
+  std::string tail;
+  std::string resp;
+  std::string code;
+  std::string error;
+
+  // The file contents are streamed from the snapshot in the file cache,
+  // between the metadata part and the closing boundary.
+  struct Source source(0, 0,
+                       [&] (char * buf, off_t offset, size_t len) -> size_t {
+                         size_t off = offset;
+                         if (off < head.size()) {
+                           len = std::min(len, head.size() - off);
+                           memcpy(buf, head.data() + off, len);
+                           return len;
+                         }
+                         off -= head.size();
+                         if (off < size) {
+                           return this->cache.get_snapshot(entry->file_id, buf, off, std::min(len, size - off), node);
+                         }
+                         off -= size;
+                         len = std::min(len, tail.size() - off);
+                         memcpy(buf, tail.data() + off, len);
+                         return len;
+                       });
+
+  query = "{ \"modifiedTime\": \"" + to_rfc3339(entry->mtime) + "\" }";
+  if (entry->pending_create &&
+      this->threadpool.take_request(entry->file_id, INSERT, item)) {
+    type    = MULTIPART_INSERT;
+    url     = GDFS_UPLOAD_URL_ "?uploadType=multipart&fields=modifiedTime%2Cmd5Checksum";
+    query   = this->threadpool.merge_requests(item.query, query);
+    created = true;
+  }
+
+  head  = "--" + boundary + "\r\n";
+  head += "Content-Type: application/json; charset=UTF-8\r\n\r\n";
+  head += query + "\r\n";
+  head += "--" + boundary + "\r\n";
+  head += "Content-Type: " + mime_type + "\r\n\r\n";
+  tail  = "\r\n--" + boundary + "--\r\n";
+
+  source.length = head.size() + size + tail.size();
+
+  try {
+    resp = this->auth.sendUpload(url, type, "Content-Type: multipart/related; boundary=" + boundary, source);
+  } catch (GDFSException & err) {
+    error = err.get();
+    goto out;
+  }
+
+  try {
+    val.clear();
+    val.parse(resp);
+  } catch (GDFSException & err) {
+    error = err.get();
+    goto out;
+  }
+
+  try {
+    code   = val["error"]["code"].get();
+    error  = "Google Drive: Error code = " + code;
+    error += ", " + val["error"]["message"].get();
+  } catch (GDFSException & err) {
+    code.clear();
+  }
+
+  if (code.empty() == false) {
+    goto out;
+  }
+
+  this->set_version(entry, resp);
+  if (created) {
+    entry->pending_create = false;
+  }
+
+out:
+  if (error.empty() == false) {
+    // Put back the INSERT request, so that the file still gets created.
+    if (created) {
+      this->threadpool.build_request(item.id, INSERT, item.node, item.url, item.query);
+    }
+    throw GDFSException(error);
+  }
+
+  Debug("<-- Exiting write_file_multipart() -->");
+}
+
+
+/*
+ * Function to take the version of an uploaded file
+ * from the response of Google Drive, keeping the bytes
+ * just uploaded valid in the cache.
+ */
+void
+GDrive::set_version (struct GDFSEntry * entry,
+                     const std::string & resp)
+{
+
+  json::Value val;
+
+  try {
+    val.parse(resp);
+    entry->mtime = entry->ctime = rfc3339_to_sec(val["modifiedTime"].get());
+  } catch (GDFSException & err) {
+    Error("Unable to get the version of %s: %s", entry->file_id.c_str(), err.get().c_str());
+    return;
+  }
+
+  // Only files with content in Drive have a checksum.
+  try {
+    entry->md5 = val["md5Checksum"].get();
+  } catch (GDFSException & err) {
+    entry->md5.clear();
+  }
+
+  this->cache.set_version(entry->file_id, entry->mtime, entry->md5);
+}
+
+
+/*
+ * Function to upload a file to Google Drive, using a resumable session.
+ * Small files are sent in a single multipart request instead.
+ * The upload is pipelined: the next chunk is loaded into the cache
+ * (downloading the ranges not in the cache) while the current chunk
+ * is being sent.
+ * The file_size bytes sent are read from the snapshot of the file
+ * in the cache, taken by the caller.
+ */
+void
+GDrive::write_file (struct GDFSNode * node,
+                    size_t file_size,
+                    UploadProgress progress)
 {
 
   Debug("<-- Entering write_file() -->");
@@ -317,7 +536,7 @@ GDrive::write_file (struct GDFSNode * node)
   json::Value val;
   bool upload_complete = false;
   struct GDFSEntry * entry = node->entry;
-  std::string url = GDFS_UPLOAD_URL + entry->file_id + "?uploadType=resumable&fields=modifiedTime";
+  std::string url = GDFS_UPLOAD_URL + entry->file_id + "?uploadType=resumable&fields=modifiedTime%2Cmd5Checksum";
   std::string resp;
   std::string query;
   std::string location;
@@ -326,20 +545,39 @@ GDrive::write_file (struct GDFSNode * node)
   std::string error;
   std::string start_str;
   std::string prefix = "Location: ";
-  std::string complete_prefix = "HTTP/1.1 200 OK";
   std::string range_prefix = "Range: bytes=0-";
   size_t size = 0;
   size_t start_ = 0;
   size_t stop_;
-  char * new_buf = NULL;
   std::istringstream m;
   int sval = 0;
+  struct Prefetch prefetch(this, node);
+  struct UploadStats stats = UploadStats();
+  uint64_t begin_ms = 0;
+  uint64_t send_ms = 0;
 
   // If its GDFS special file, no writes to Google Drive.
   if (entry->file_id.compare(0, gdfs_name_prefix.size(), gdfs_name_prefix) == 0) {
     return;
   }
 
+  if (file_size <= GDFS_MULTIPART_MAX_SIZE) {
+    begin_ms = now_ms();
+    try {
+      write_file_multipart(node, file_size);
+    } catch (GDFSException & err) {
+      error = err.get();
+      goto out;
+    }
+    stats.send_ms += now_ms() - begin_ms;
+    stats.bytes   += file_size;
+    ++stats.chunks;
+    if (progress) {
+      progress(file_size, file_size);
+    }
+    goto out;
+  }
+
   // Construct the request.
   if (entry->mime_type.empty() == false) {
     headers = "X-Upload-Content-Type: " + entry->mime_type;
@@ -357,7 +595,7 @@ GDrive::write_file (struct GDFSNode * node)
   // Get the location to send the data.
   m.str(resp);
   while (std::getline(m, line)) {
-    if (line.compare(0, prefix.size(), prefix) == 0) {
+    if (strncasecmp(line.c_str(), prefix.c_str(), prefix.size()) == 0) {
       location = line.substr(prefix.size());
       location.pop_back();
       break;
@@ -369,23 +607,38 @@ GDrive::write_file (struct GDFSNode * node)
     goto out;
   }
 
-  // Upload the updated file in chunks to Google Drive using threadpool.
+  // Upload the updated file in chunks to Google Drive.
+  // Every chunk is streamed straight from the snapshot in the file cache.
   size   = 0;
   start_ = 0;
-  stop_  = entry->file_size < GDFS_UPLOAD_CHUNK_SIZE ? entry->file_size - 1 : GDFS_UPLOAD_CHUNK_SIZE - 1;
-  new_buf = new char[GDFS_UPLOAD_CHUNK_SIZE];
-  while (size < entry->file_size) {
-    this->cache.get(entry->file_id, new_buf, start_, stop_ - start_ + 1, node);
-    query   = std::string(new_buf, (stop_ - start_ + 1));
-    headers = "Content-Range: bytes " + std::to_string(start_) + "-" + std::to_string(stop_) + "/" + std::to_string(entry->file_size);
+  stop_  = file_size < GDFS_UPLOAD_CHUNK_SIZE ? file_size - 1 : GDFS_UPLOAD_CHUNK_SIZE - 1;
+  begin_ms = now_ms();
+  while (size < file_size) {
+    struct Source source(start_, stop_ - start_ + 1,
+                         [this, entry, node] (char * buf, off_t offset, size_t len) -> size_t {
+                           return this->cache.get_snapshot(entry->file_id, buf, offset, len, node);
+                         });
+    headers = "Content-Range: bytes " + std::to_string(start_) + "-" + std::to_string(stop_) + "/" + std::to_string(file_size);
+
+    // Wait for this chunk to be loaded,
+    // and start loading the next one.
+    stats.stall_ms += finish_prefetch(prefetch);
+    if (stop_ + 1 < file_size) {
+      start_prefetch(prefetch, stop_ + 1,
+                     std::min((size_t) GDFS_UPLOAD_CHUNK_SIZE, file_size - stop_ - 1));
+    }
 
 retry:
+    send_ms = now_ms();
     try {
-      resp = this->auth.sendRequest(location, UPLOAD, query, false, headers);
+      resp = this->auth.sendUpload(location, UPLOAD, headers, source);
     } catch (GDFSException & err) {
       error = err.get();
       goto out;
     }
+    stats.send_ms += now_ms() - send_ms;
+    stats.bytes += source.length;
+    ++stats.chunks;
 
     try {
       val.clear();
@@ -400,17 +653,24 @@ retry:
 
     m.str(resp);
     while (std::getline(m, line)) {
-      if (line.compare(0, range_prefix.size(), range_prefix) == 0) {
+      if (strncasecmp(line.c_str(), range_prefix.c_str(), range_prefix.size()) == 0) {
         start_str = line.substr(range_prefix.size());
         start_str.pop_back();
         break;
-      } else if (line.compare(0, complete_prefix.size(), complete_prefix) == 0) {
+      } else if (is_status_ok(line)) {
         upload_complete = true;
         break;
       }
     }
     m.clear();
     if (upload_complete == true) {
+      // The body of the last response is the uploaded file.
+      if (resp.find('{') != std::string::npos) {
+        this->set_version(entry, resp.substr(resp.find('{')));
+      }
+      if (progress) {
+        progress(file_size, file_size);
+      }
       break;
     }
 
@@ -420,10 +680,10 @@ retry:
 
 retry_write:
     if (start_str.empty() == true) {
-      headers = "Content-Range: bytes */" + std::to_string(entry->file_size);
+      headers = "Content-Range: bytes */" + std::to_string(file_size);
 
       try {
-        resp = this->auth.sendRequest(location, UPLOAD, query, false, headers);
+        resp = this->auth.sendRequest(location, UPLOAD, "", false, headers);
       } catch (GDFSException & err) {
         error = err.get();
         goto out;
@@ -431,7 +691,7 @@ retry_write:
 
       m.str(resp);
       while (std::getline(m, line)) {
-        if (line.compare(0, range_prefix.size(), range_prefix) == 0) {
+        if (strncasecmp(line.c_str(), range_prefix.c_str(), range_prefix.size()) == 0) {
           start_str = line.substr(range_prefix.size());
           start_str.pop_back();
           break;
@@ -449,13 +709,30 @@ retry_write:
     }
 
     sscanf(start_str.c_str(), "%zu", &size);
+    if (progress) {
+      progress(size + 1, file_size);
+    }
     start_ = size + 1;
-    stop_  = ((entry->file_size - size) < GDFS_UPLOAD_CHUNK_SIZE ? (start_ + entry->file_size - size - 2) : (start_ + GDFS_UPLOAD_CHUNK_SIZE - 1));
+    stop_  = ((file_size - size) < GDFS_UPLOAD_CHUNK_SIZE ? (start_ + file_size - size - 2) : (start_ + GDFS_UPLOAD_CHUNK_SIZE - 1));
   }
 
 out:
-  if (new_buf != NULL) {
-    delete[] new_buf;
+  stats.stall_ms += finish_prefetch(prefetch);
+
+  if (stats.chunks > 0) {
+    stats.uploads = 1;
+    Info("Uploaded %s: %llu bytes in %llu chunks, %llu KB/s, %llu ms sending, %llu ms waiting for the cache",
+         node->file_name.c_str(), stats.bytes, stats.chunks,
+         stats.bytes / std::max((uint64_t) 1, now_ms() - begin_ms),
+         stats.send_ms, stats.stall_ms);
+
+    pthread_mutex_lock(&stats_lock);
+    this->upload_stats.uploads  += stats.uploads;
+    this->upload_stats.chunks   += stats.chunks;
+    this->upload_stats.bytes    += stats.bytes;
+    this->upload_stats.send_ms  += stats.send_ms;
+    this->upload_stats.stall_ms += stats.stall_ms;
+    pthread_mutex_unlock(&stats_lock);
   }
 
   if (error.empty() == false) {
@@ -467,6 +744,15 @@ out:
 }
 
 
+void
+GDrive::get_upload_stats (struct UploadStats & stats)
+{
+  pthread_mutex_lock(&stats_lock);
+  stats = this->upload_stats;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
 bool
 GDrive::get_root (void)
 {
@@ -597,6 +883,7 @@ GDrive::get_children (struct GDFSNode * parent)
   std::string parent_file_id = parent->entry->file_id;
   std::string change_id_;
   std::string mime_type;
+  std::string md5;
   json::Value val;
   json::Value * child;
   mode_t file_mode;
@@ -702,7 +989,7 @@ retry_parent:
   // Construct the URL to send the request.
   url  = GDFS_FILE_URL_ + std::string("?pageSize=1000&q='") + parent_file_id;
   url += "'+in+parents+and+trashed+%3D+false&orderBy=name&spaces=drive";
-  url += "&fields=files(id%2CmimeType%2CmodifiedTime%2Cname%2Csize%2CviewedByMeTime)%2CnextPageToken";
+  url += "&fields=files(id%2Cmd5Checksum%2CmimeType%2CmodifiedTime%2Cname%2Csize%2CviewedByMeTime)%2CnextPageToken";
 
   // Retrieve the list of children.
 retry_children:
@@ -738,7 +1025,7 @@ retry_children:
     try {
       url  = GDFS_FILE_URL_ + std::string("?pageSize=1000&q='") + parent_file_id;
       url += "'+in+parents+and+trashed+%3D+false&orderBy=name&spaces=drive&pageToken=" + val["nextPageToken"].get();
-      url += "&fields=files(id%2CmimeType%2CmodifiedTime%2Cname%2Csize%2CviewedByMeTime)%2CnextPageToken";
+      url += "&fields=files(id%2Cmd5Checksum%2CmimeType%2CmodifiedTime%2Cname%2Csize%2CviewedByMeTime)%2CnextPageToken";
     } catch (GDFSException & err) {
       url = "";
     }
@@ -755,6 +1042,13 @@ retry_children:
       file_id = child->find("id")->get();
       mtime   = rfc3339_to_sec(child->find("modifiedTime")->get());
 
+      // Only files with content in Drive have a checksum.
+      try {
+        md5 = child->find("md5Checksum")->get();
+      } catch (GDFSException & err) {
+        md5 = "";
+      }
+
       // If the file has not been viewed by this user before,
       // viewedByMeTime wont exist.
       try {
@@ -825,6 +1119,7 @@ retry_children:
           }
           entry->atime = atime;
           entry->mtime = mtime;
+          entry->md5   = md5;
         } else {
           // Name conflict.
           if (g_doc == false &&
@@ -839,6 +1134,7 @@ retry_children:
           }
           entry->atime = atime;
           entry->mtime = mtime;
+          entry->md5   = md5;
         }
 
       } else {
@@ -846,6 +1142,7 @@ retry_children:
         file_name = remove_name_conflict(file_name, is_dir, parent);
         entry = new GDFSEntry(file_id, file_size, is_dir,
                               atime, mtime, this->uid, this->gid, file_mode, mime_type, g_doc);
+        entry->md5 = md5;
         child_node = parent->insert(new GDFSNode(file_name, entry, parent));
         file_id_node.emplace(file_id, child_node);
         Debug("Created a new entry for %s in directory structure", file_name.c_str());
@@ -1050,6 +1347,11 @@ GDrive::delete_file (struct GDFSNode * node,
   std::queue <struct GDFSNode *> q_nodes;
   std::unordered_map <std::string, struct GDFSNode *>::iterator it_node;
 
+  // Drop its pending upload, if any.
+  if (entry->is_dir == false) {
+    this->writeback.cancel(entry);
+  }
+
   // Remove it from parent list if not root node.
   if (node->parent) {
     node->parent->remove_child(node);
@@ -45,6 +45,7 @@
 #include <queue>
 #include <cstdint>
 #include <map>
+#include <functional>
 
 #include <pthread.h>
 #include <semaphore.h>
@@ -55,6 +56,7 @@
 #include "auth.h"
 #include "cache.h"
 #include "threadpool.h"
+#include "writeback.h"
 
 
 const std::string gdfs_name_prefix = "null";
@@ -70,6 +72,23 @@ is_old_name_conflict (const std::string & new_file_name,
 
 
 
+// Called after every chunk of an upload, with the number of bytes
+// of the file stored in Google Drive so far.
+typedef std::function <void (uint64_t sent, uint64_t total)> UploadProgress;
+
+
+// Throughput counters of the uploads to Google Drive.
+// send_ms is the time spent sending chunks, and stall_ms the time
+// the upload waited for the next chunk to be loaded into the cache.
+struct UploadStats {
+  uint64_t uploads;
+  uint64_t chunks;
+  uint64_t bytes;
+  uint64_t send_ms;
+  uint64_t stall_ms;
+};
+
+
 /*********************************************/
 /*            GDFS CORE FUNCTIONS            */
 /*                                           */
@@ -90,27 +109,35 @@ class GDrive {
     Auth auth;
     LRUCache cache;
     Threadpool threadpool;
+    Writeback writeback;
     struct GDFSNode * root;
+    struct UploadStats upload_stats;
+    pthread_mutex_t stats_lock;
 
     GDrive (const std::string & rootDir_,
             const std::string & path_) :
       rootDir(rootDir_),
       auth(path_ + "gdfs.auth"),
-      cache(auth),
+      cache(auth, disk_cache_dir.empty() ? path_ : disk_cache_dir),
       threadpool(this, auth),
+      writeback(this),
       root(NULL)
     {
       mounting_time = time(NULL);
       uid           = getuid();
       gid           = getgid();
+      upload_stats  = UploadStats();
+      pthread_mutex_init(&stats_lock, NULL);
     }
 
 
     ~GDrive (void)
     {
+      this->writeback.drain();
       if (this->root) {
         this->delete_file(this->root, false);
       }
+      pthread_mutex_destroy(&stats_lock);
     }
 
 
@@ -179,7 +206,20 @@ class GDrive {
     download_file (struct GDFSNode * node);
 
     void
-    write_file (struct GDFSNode * node);
+    write_file (struct GDFSNode * node,
+                size_t file_size,
+                UploadProgress progress = nullptr);
+
+    void
+    write_file_multipart (struct GDFSNode * node,
+                          size_t size);
+
+    void
+    set_version (struct GDFSEntry * entry,
+                 const std::string & resp);
+
+    void
+    get_upload_stats (struct UploadStats & stats);
 
     void
     set_utime (struct GDFSNode * node);
@@ -74,6 +74,52 @@ gdfs_init (struct fuse_conn_info * conn)
 void
 gdfs_destroy (void * userdata)
 {
+  PoolStats stats;
+  struct UploadStats upload;
+  struct DiskCacheStats disk;
+  struct DirtyStats dirty;
+  struct EvictStats evict;
+  struct SlabStats arena;
+
+  // Wait for the files still being uploaded.
+  if (GDFS_DATA != NULL) {
+    Info("Waiting for the pending uploads...");
+    GDFS_DATA->writeback.drain();
+    GDFS_DATA->cache.save();
+  }
+
+  Request::getPoolStats(stats);
+  Info("Connection pool: %llu hits, %llu misses", stats.hits, stats.misses);
+  Info("Async requests: %llu completed, %llu over HTTP/2", stats.requests, stats.multiplexed);
+
+  if (GDFS_DATA != NULL) {
+    GDFS_DATA->get_upload_stats(upload);
+    Info("Uploads: %llu files, %llu chunks, %llu bytes, %llu ms sending, %llu ms waiting for the cache",
+         upload.uploads, upload.chunks, upload.bytes, upload.send_ms, upload.stall_ms);
+
+    GDFS_DATA->cache.get_dirty_stats(dirty);
+    Info("Dirty data: %llu bytes left, %llu bytes at peak, %llu writes held back for %llu ms",
+         (unsigned long long) dirty.bytes, (unsigned long long) dirty.peak,
+         (unsigned long long) dirty.throttled, (unsigned long long) dirty.throttle_ms);
+
+    GDFS_DATA->cache.get_disk_stats(disk);
+    Info("Disk cache: %llu bytes read, %llu bytes stored, %llu bytes dropped",
+         (unsigned long long) disk.hits, (unsigned long long) disk.stored, (unsigned long long) disk.evicted);
+
+    GDFS_DATA->cache.get_evict_stats(evict);
+    Info("Eviction: %llu bytes reclaimed in %llu runs (%llu KB/s), %llu reads and writes evicted inline for %llu ms",
+         (unsigned long long) evict.reclaimed, (unsigned long long) evict.runs,
+         (unsigned long long) (evict.reclaim_ms ? evict.reclaimed / evict.reclaim_ms : 0),
+         (unsigned long long) evict.stalls, (unsigned long long) evict.stall_ms);
+
+    slab.get_stats(arena);
+    Info("Cache memory: %llu bytes mapped in %llu regions, %llu bytes in use, %llu bytes free (%llu%%), %llu allocations, %llu splits",
+         (unsigned long long) arena.mapped, (unsigned long long) arena.regions,
+         (unsigned long long) arena.used, (unsigned long long) arena.idle,
+         (unsigned long long) (arena.mapped ? arena.idle * 100 / arena.mapped : 0),
+         (unsigned long long) arena.allocs, (unsigned long long) arena.splits);
+  }
+
   Info("Unmounting GDFS filesytem...");
 }
 
@@ -959,7 +1005,7 @@ gdfs_rename (const char * path,
   // Rename file in Google Drive.
   state->rename_file(node, new_file_name);
   if (to_write) {
-    state->write_file(node);
+    state->writeback.schedule(node);
   }
 
 out:
@@ -1119,9 +1165,6 @@ gdfs_truncate (const char * path,
   Debug("<-- Entering write() SYSCALL -->");
 
   int ret = 0;
-  off_t start = 0;
-  size_t size;
-  char * buf = NULL;
   time_t mtime;
   std::string url;
   std::string resp;
@@ -1162,21 +1205,10 @@ gdfs_truncate (const char * path,
   } else {
     entry->write = true;
 
-    start = newsize > entry->file_size ? entry->file_size : newsize - 1;
-    size = newsize > entry->file_size ? (newsize - entry->file_size) : (entry->file_size - newsize);
-    if (start > entry->file_size) {
-      buf = new char[size];
-      assert(buf != NULL);
-      memset(buf, 0, size);
-    }
-
     // Update cache with the updated file.
+    // The bytes added are a hole, taking no memory in the cache.
     if (newsize > entry->file_size) {
-      if (state->cache.put(entry->file_id, buf, start, size, node, false) == false) {
-        ret = -EAGAIN;
-        Error("truncate(): unable to write %s to cache", path);
-        goto out;
-      }
+      state->cache.extend(entry->file_id, newsize, node);
     } else if (newsize < entry->file_size) {
       state->cache.resize(entry->file_id, newsize);
     }
@@ -1185,6 +1217,7 @@ gdfs_truncate (const char * path,
   state->cache.set_time(entry->file_id, mtime);
   entry->mtime = entry->ctime = mtime;
   entry->file_size = newsize;
+  entry->md5.clear();
 
 out:
   Debug("<-- Exiting truncate() SYSCALL -->");
@@ -1350,12 +1383,16 @@ gdfs_read (const char * path,
   // Read the file from cache.
   size = (size > entry->file_size ? entry->file_size : size);
   try {
-    ret = state->cache.get(entry->file_id, buf, offset, size, node);
+    ret = state->cache.get(entry->file_id, buf, offset, size, node, true);
   } catch (GDFSException & err) {
     ret = -EAGAIN;
     Error("read(): %s, %s", path, err.get().c_str());
     goto out;
   }
+  if (ret < 0) {
+    Error("read(): %s, unable to download the data", path);
+    goto out;
+  }
 
   // Update the file access time.
   entry->atime = time(NULL);
@@ -1410,11 +1447,31 @@ gdfs_write (const char * path,
     goto out;
   }
 
+  // Too much of the cache is not saved in Google Drive yet.
+  // Upload this file and the ones queued right away,
+  // and hold the write until some of it is saved.
+  if (state->cache.dirty_full()) {
+    state->writeback.schedule(node, true);
+    state->writeback.hurry();
+    state->cache.wait_dirty();
+  }
+
   // Put the updated file into cache.
+  // The file size is updated only after, so that the cache
+  // knows which bytes of the file were there before the write.
   entry->mtime = time(NULL);
-  entry->file_size = entry->file_size > (offset + size) ? entry->file_size : (offset + size);
   try {
-    ret = state->cache.put(entry->file_id, const_cast<char*>(buf), offset, size, node, false);
+    // A write past the end of the file leaves a hole before it.
+    if (offset > (off_t) entry->file_size) {
+      state->cache.extend(entry->file_id, offset, node);
+    }
+    if (state->cache.put(entry->file_id, const_cast<char*>(buf), offset, size, node, false) == false) {
+      ret = -EIO;
+      Error("write(): %s, unable to download the data around the write", path);
+      goto out;
+    }
+    entry->file_size = entry->file_size > (offset + size) ? entry->file_size : (offset + size);
+    entry->md5.clear();
     entry->write = true;
   } catch (GDFSException & err) {
     ret = -EAGAIN;
@@ -1424,7 +1481,7 @@ gdfs_write (const char * path,
 
 out:
   Debug("<-- Exiting write() SYSCALL -->");
-  return size;
+  return (ret < 0) ? ret : size;
 }
 
 
@@ -1441,7 +1498,6 @@ gdfs_release (const char * path,
   struct GDrive * state = GDFS_DATA;
   struct GDFSNode * node = NULL;
   struct GDFSEntry * entry = NULL;
-  std::string s;
 
   // Check for invalid parameters from fuse.
   if (path == NULL || *path == 0) {
@@ -1467,15 +1523,9 @@ gdfs_release (const char * path,
     goto out;
   }
 
-  // Write the file to Google Drive.
-  s = rand_str();
-  try {
-    if (entry->file_size > 0 && entry->write) {
-      state->write_file(node);
-    }
-  } catch (GDFSException & err) {
-    ret = -EAGAIN;
-    Error("release(): %s, %s", path, err.get().c_str());
+  // Write the file to Google Drive in the background.
+  if (entry->file_size > 0 && entry->write) {
+    state->writeback.schedule(node);
   }
   entry->write = false;
   entry->file_open = false;
@@ -1486,6 +1536,106 @@ out:
 }
 
 
+/*
+ * Called on every close() of a file.
+ * Starts the upload of the data written so far, without waiting for it.
+ * close() must not block on the upload; fsync() is the call to wait on.
+ */
+int
+gdfs_flush (const char * path,
+            struct fuse_file_info * /* fi */)
+{
+
+  Debug("<-- Entering flush() SYSCALL -->");
+
+  int ret = 0;
+  uid_t uid = fuse_get_context()->uid;
+  gid_t gid = fuse_get_context()->gid;
+  struct GDrive * state = GDFS_DATA;
+  struct GDFSNode * node = NULL;
+  struct GDFSEntry * entry = NULL;
+
+  // Check for invalid parameters from fuse.
+  if (path == NULL || *path == 0) {
+    ret = -EINVAL;
+    Error("flush(): invalid parameters from fuse");
+    goto out;
+  }
+
+  // Check whether the file exists.
+  try {
+    node = state->get_node(path, uid, gid);
+  } catch (GDFSException & err) {
+    ret = -errno;
+    Error("flush(): %s, %s", path, err.get().c_str());
+    goto out;
+  }
+  entry = node->entry;
+
+  if (entry->file_size > 0 && entry->write) {
+    state->writeback.schedule(node);
+    entry->write = false;
+  }
+
+out:
+  Debug("<-- Exiting flush() SYSCALL -->");
+  return ret;
+}
+
+
+/*
+ * Waits until the file is safe in Google Drive.
+ * The data and the metadata of a file are uploaded together,
+ * so datasync is ignored.
+ */
+int
+gdfs_fsync (const char * path,
+            int /* datasync */,
+            struct fuse_file_info * /* fi */)
+{
+
+  Debug("<-- Entering fsync() SYSCALL -->");
+
+  int ret = 0;
+  uid_t uid = fuse_get_context()->uid;
+  gid_t gid = fuse_get_context()->gid;
+  struct GDrive * state = GDFS_DATA;
+  struct GDFSNode * node = NULL;
+  struct GDFSEntry * entry = NULL;
+
+  // Check for invalid parameters from fuse.
+  if (path == NULL || *path == 0) {
+    ret = -EINVAL;
+    Error("fsync(): invalid parameters from fuse");
+    goto out;
+  }
+
+  // Check whether the file exists.
+  try {
+    node = state->get_node(path, uid, gid);
+  } catch (GDFSException & err) {
+    ret = -errno;
+    Error("fsync(): %s, %s", path, err.get().c_str());
+    goto out;
+  }
+  entry = node->entry;
+
+  // Upload the data written so far, and wait for it.
+  if (entry->file_size > 0 && entry->write) {
+    state->writeback.schedule(node);
+    entry->write = false;
+  }
+  ret = -state->writeback.wait(entry);
+  if (ret != 0) {
+    Error("fsync(): unable to upload %s", path);
+  }
+
+out:
+  Debug("<-- Exiting fsync() SYSCALL -->");
+  return ret;
+}
+
+
 int
 gdfs_statfs (const char * path,
              struct statvfs * statv)
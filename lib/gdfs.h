@@ -113,7 +113,7 @@ struct initFUSEoper {
     gdfs_oper.create      = gdfs_create;
     gdfs_oper.init        = gdfs_init;
     gdfs_oper.destroy     = gdfs_destroy;
-    gdfs_oper.flush       = NULL;
+    gdfs_oper.flush       = gdfs_flush;
     gdfs_oper.getdir      = NULL;
     gdfs_oper.utimens     = NULL;
     gdfs_oper.opendir     = NULL; //gdfs_opendir;
@@ -124,7 +124,7 @@ struct initFUSEoper {
     gdfs_oper.removexattr = NULL;
     gdfs_oper.fsyncdir    = NULL;
     gdfs_oper.fallocate   = NULL;
-    gdfs_oper.fsync       = NULL;
+    gdfs_oper.fsync       = gdfs_fsync;
     gdfs_oper.ftruncate   = NULL;
     gdfs_oper.fgetattr    = NULL; //gdfs_fgetattr;
     gdfs_oper.write_buf   = NULL;
@@ -36,33 +36,119 @@
 
 
 #include <fstream>
+#include <algorithm>
 
 #include <stdlib.h>
 #include <curl/curl.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "request.h"
 #include "conf.h"
 #include "common.h"
+#include "log.h"
 #include "exception.h"
 
 
+/*
+ * Pool of curl handles.
+ * Every thread (FUSE threads as well as the request queue workers)
+ * keeps its own easy handle alive between requests, so that the
+ * connection to Google Drive is reused instead of doing a new
+ * TCP connect and TLS handshake for every request.
+ * All the handles share the DNS, TLS session and connection caches.
+ *
+ * The handles of the async engine share only the DNS and TLS session
+ * caches. Their connections stay in the cache of the multi handle,
+ * which multiplexes the requests as HTTP/2 streams.
+ */
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static CURLSH * pool_share = NULL;
+static CURLSH * engine_share = NULL;
+static pthread_mutex_t pool_share_lock[CURL_LOCK_DATA_LAST];
+static pthread_mutex_t pool_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static PoolStats pool_stats = {0, 0, 0, 0};
+
+
+static void
+pool_lock (CURL * /* handle */,
+           curl_lock_data data,
+           curl_lock_access /* access */,
+           void * /* userp */)
+{
+  pthread_mutex_lock(&pool_share_lock[data]);
+}
+
+
+static void
+pool_unlock (CURL * /* handle */,
+             curl_lock_data data,
+             void * /* userp */)
+{
+  pthread_mutex_unlock(&pool_share_lock[data]);
+}
+
+
+// Called when a thread exits, to release its handle.
+static void
+pool_free_handle (void * curl)
+{
+  curl_easy_cleanup((CURL *) curl);
+}
+
+
+static void
+pool_init (void)
+{
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&pool_share_lock[i], NULL);
+  }
+
+  pthread_key_create(&pool_key, pool_free_handle);
+
+  pool_share = curl_share_init();
+  if (pool_share != NULL) {
+    curl_share_setopt(pool_share, CURLSHOPT_LOCKFUNC, pool_lock);
+    curl_share_setopt(pool_share, CURLSHOPT_UNLOCKFUNC, pool_unlock);
+    curl_share_setopt(pool_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(pool_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(pool_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  }
+
+  engine_share = curl_share_init();
+  if (engine_share != NULL) {
+    curl_share_setopt(engine_share, CURLSHOPT_LOCKFUNC, pool_lock);
+    curl_share_setopt(engine_share, CURLSHOPT_UNLOCKFUNC, pool_unlock);
+    curl_share_setopt(engine_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(engine_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+}
+
+
 // Set Client ID, Client Secret, Redirect URI
-Request::Request (void)
+Request::Request (void) :
+  engine(NULL)
 {
   this->clientId     = GDFS_CLIENT_ID;
   this->clientSecret = GDFS_CLIENT_SECRET;
   this->redirectUri  = GDFS_REDIRECT_URI;
+  pthread_mutex_init(&engineLock, NULL);
 }
 
 
-Request::Request (const std::string & confFile)
+Request::Request (const std::string & confFile) :
+  engine(NULL)
 {
 
   this->clientId     = GDFS_CLIENT_ID;
   this->clientSecret = GDFS_CLIENT_SECRET;
   this->redirectUri  = GDFS_REDIRECT_URI;
   this->confFile     = confFile;
+  pthread_mutex_init(&engineLock, NULL);
 
   //curl_global_init(CURL_GLOBAL_ALL);
 }
@@ -70,6 +156,8 @@ Request::Request (const std::string & confFile)
 
 Request::~Request (void)
 {
+  this->clear();
+  pthread_mutex_destroy(&engineLock);
   //curl_global_cleanup();
 }
 
@@ -77,6 +165,17 @@ Request::~Request (void)
 void
 Request::clear (void)
 {
+
+  AsyncEngine * engine_ = NULL;
+
+  // The engine is deleted without the lock, as the callbacks
+  // of the requests it fails may send new requests.
+  pthread_mutex_lock(&engineLock);
+  engine_ = this->engine;
+  this->engine = NULL;
+  pthread_mutex_unlock(&engineLock);
+
+  delete engine_;
   //curl_global_cleanup();
 }
 
@@ -127,6 +226,78 @@ Request::getTokens (AuthObj & obj)
 }
 
 
+/*
+ * Function to get the curl handle of the calling thread.
+ * The handle is created on first use, and reset on every other use.
+ * Resetting a handle keeps its live connections.
+ */
+CURL *
+Request::getHandle (void)
+{
+
+  CURL * curl = NULL;
+
+  pthread_once(&pool_once, pool_init);
+
+  curl = (CURL *) pthread_getspecific(pool_key);
+  if (curl != NULL) {
+    curl_easy_reset(curl);
+
+    pthread_mutex_lock(&pool_stats_lock);
+    ++pool_stats.hits;
+    pthread_mutex_unlock(&pool_stats_lock);
+  } else {
+    if ((curl = curl_easy_init()) == NULL) {
+      return NULL;
+    }
+    pthread_setspecific(pool_key, curl);
+
+    pthread_mutex_lock(&pool_stats_lock);
+    ++pool_stats.misses;
+    pthread_mutex_unlock(&pool_stats_lock);
+  }
+
+  initHandle(curl);
+
+  return curl;
+}
+
+
+/*
+ * Function to set the options common to every pooled handle.
+ * HTTP/2 is negotiated over TLS, falling back to HTTP/1.1.
+ * Handles of the async engine wait for a connection that can be
+ * multiplexed, rather than opening a new one.
+ */
+void
+Request::initHandle (CURL * curl,
+                     bool multiplex)
+{
+  CURLSH * share = (multiplex ? engine_share : pool_share);
+
+  pthread_once(&pool_once, pool_init);
+
+  if (share != NULL) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  }
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+  if (multiplex) {
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  }
+}
+
+
+void
+Request::getPoolStats (PoolStats & stats)
+{
+  pthread_mutex_lock(&pool_stats_lock);
+  stats = pool_stats;
+  pthread_mutex_unlock(&pool_stats_lock);
+}
+
+
 size_t
 Request::writeCallback (void * contents,
                         size_t size,
@@ -138,31 +309,198 @@ Request::writeCallback (void * contents,
 }
 
 
-std::string
-Request::sendRequest (const std::string & url,
+/*
+ * Write callback of a download into a Sink.
+ * A short count is returned once the expected length has been written,
+ * which makes curl abort the rest of the transfer.
+ */
+size_t
+Request::sinkCallback (void * contents,
+                       size_t size,
+                       size_t nmemb,
+                       void * userp)
+{
+
+  struct Sink * sink = (struct Sink *) userp;
+  const char * src = (const char *) contents;
+  size_t len = size * nmemb;
+  size_t count = 0;
+  size_t n = 0;
+
+  // Keep the error responses away from the destination.
+  if (sink->code == 0) {
+    curl_easy_getinfo(sink->curl, CURLINFO_RESPONSE_CODE, &sink->code);
+  }
+  if (sink->code != 200 && sink->code != 206) {
+    sink->error.append(src, len);
+    return len;
+  }
+
+  // Full body, instead of the range asked for.
+  if (sink->code == 200 && sink->skipped < sink->start) {
+    count = std::min(len, sink->start - sink->skipped);
+    sink->skipped += count;
+  }
+
+  while (count < len &&
+         sink->written < sink->expected &&
+         sink->index < sink->iovcnt) {
+    const struct iovec & v = sink->iov[sink->index];
+    n = std::min(len - count, v.iov_len - sink->offset);
+    n = std::min(n, sink->expected - sink->written);
+
+    memcpy((char *) v.iov_base + sink->offset, src + count, n);
+    count += n;
+    sink->written += n;
+    sink->offset += n;
+    if (sink->offset == v.iov_len) {
+      ++sink->index;
+      sink->offset = 0;
+    }
+  }
+
+  return count;
+}
+
+
+/*
+ * Read callback of an upload from a Source.
+ */
+size_t
+Request::sourceCallback (char * buffer,
+                         size_t size,
+                         size_t nitems,
+                         void * userp)
+{
+
+  struct Source * source = (struct Source *) userp;
+  size_t len = std::min(size * nitems, source->length - source->sent);
+  size_t n = 0;
+
+  if (len == 0) {
+    return 0;
+  }
+
+  try {
+    n = source->read(buffer, source->start + source->sent, len);
+  } catch (...) {
+    n = 0;
+  }
+
+  // The source ran dry before the whole body was sent.
+  if (n == 0) {
+    return CURL_READFUNC_ABORT;
+  }
+
+  source->sent += n;
+  return n;
+}
+
+
+/*
+ * Seek callback of an upload from a Source.
+ * Used by curl to rewind the body, when the request has to be resent.
+ */
+int
+Request::seekCallback (void * userp,
+                       curl_off_t offset,
+                       int origin)
+{
+
+  struct Source * source = (struct Source *) userp;
+
+  if (origin != SEEK_SET ||
+      offset < 0 ||
+      (size_t) offset > source->length) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  source->sent = offset;
+
+  return CURL_SEEKFUNC_OK;
+}
+
+
+/*
+ * Function to write the response of a request into a Sink,
+ * instead of a string.
+ */
+void
+Request::setupSink (CURL * curl,
+                    struct Sink * sink)
+{
+  sink->curl = curl;
+  sink->written = 0;
+  sink->code = 0;
+  sink->index = 0;
+  sink->offset = 0;
+  sink->skipped = 0;
+  sink->error.clear();
+
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sinkCallback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, sink);
+}
+
+
+/*
+ * Function to stream the body of a request from a Source.
+ */
+void
+Request::setupSource (CURL * curl,
+                      struct Source * source)
+{
+  source->sent = 0;
+
+  curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+  curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t) source->length);
+  curl_easy_setopt(curl, CURLOPT_READFUNCTION, sourceCallback);
+  curl_easy_setopt(curl, CURLOPT_READDATA, source);
+  curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seekCallback);
+  curl_easy_setopt(curl, CURLOPT_SEEKDATA, source);
+  curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, (long) GDFS_UPLOAD_BUFFER_SIZE);
+}
+
+
+/*
+ * Function to check whether a request has succeeded.
+ * A download cut short once its destination was full has succeeded.
+ */
+bool
+Request::checkResult (struct Transfer & t,
+                      CURLcode result)
+{
+  if (result == CURLE_OK) {
+    return true;
+  }
+
+  return (result == CURLE_WRITE_ERROR &&
+          t.sink != NULL &&
+          t.sink->error.empty() &&
+          (t.sink->written == t.sink->expected ||
+           t.sink->index == t.sink->iovcnt));
+}
+
+
+/*
+ * Function to set the url, headers and body of a request on a curl handle.
+ * query shall be the body of the request, and must stay alive until the
+ * request is completed. The response is written into buf.
+ * Returns the list of headers, to be freed once the request is completed.
+ */
+struct curl_slist *
+Request::setupHandle (CURL * curl,
+                      const std::string & url,
                       requestType reqType,
-                      std::string query,
+                      std::string & query,
                       bool secret,
-                      std::string headers_)
+                      const std::string & headers_,
+                      std::string * buf,
+                      struct Source * source)
 {
 
-  std::string buf;
   std::string new_url;
   std::string header = std::string();
-  CURL * curl = NULL;
-  CURLcode resp;
   struct curl_slist * headers = NULL;
 
-  // Check to see whether curl is installed,
-  // and working fine.
-  try {
-    if ((curl = curl_easy_init()) == NULL) {
-      throw GDFSException("Unable to use curl library");
-    }
-  } catch (...) {
-    throw GDFSException("Install libcurl-devel package");
-  }
-
   if (url.find("?") != std::string::npos) {
     new_url = url + "&quotaUser=" + rand_str();
   } else {
@@ -173,8 +511,11 @@ Request::sendRequest (const std::string & url,
   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
   curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 60L);
+  // Give up on a transfer that has stalled, instead of waiting for ever.
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long) GDFS_LOW_SPEED_LIMIT);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long) GDFS_LOW_SPEED_TIME);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, buf);
 
   // Construct the headers and query, based on request type.
   switch (reqType) {
@@ -226,20 +567,39 @@ Request::sendRequest (const std::string & url,
     case UPLOAD:
       header = "Authorization: Bearer " + this->accessToken;
       headers = curl_slist_append(headers, header.c_str());
-      header = "Content-Length: " + std::to_string(query.size());
+      header = "Content-Length: " + std::to_string(source ? source->length : query.size());
       headers = curl_slist_append(headers, header.c_str());
       if (headers_.empty() == false) {
         headers = curl_slist_append(headers, headers_.c_str());
       }
       curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
       curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-      if (query.empty() == false) {
+      if (source != NULL) {
+        setupSource(curl, source);
+      } else if (query.empty() == false) {
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, query.c_str());
         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, query.size());
       }
       curl_easy_setopt(curl, CURLOPT_HEADER, 1);
       break;
 
+    case MULTIPART_INSERT:
+    case MULTIPART_UPDATE:
+      header = "Authorization: Bearer " + this->accessToken;
+      headers = curl_slist_append(headers, header.c_str());
+      headers = curl_slist_append(headers, headers_.c_str());
+      header = "Content-Length: " + std::to_string(source ? source->length : query.size());
+      headers = curl_slist_append(headers, header.c_str());
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+      curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, (reqType == MULTIPART_INSERT ? "POST" : "PATCH"));
+      if (source != NULL) {
+        setupSource(curl, source);
+      } else {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, query.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, query.size());
+      }
+      break;
+
     case UPDATE:
       header = "Authorization: Bearer " + this->accessToken;
       headers = curl_slist_append(headers, header.c_str());
@@ -252,6 +612,18 @@ Request::sendRequest (const std::string & url,
       curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, query.size());
       break;
 
+    case BATCH:
+      header = "Authorization: Bearer " + this->accessToken;
+      headers = curl_slist_append(headers, header.c_str());
+      headers = curl_slist_append(headers, headers_.c_str());
+      header = "Content-Length: " + std::to_string(query.size());
+      headers = curl_slist_append(headers, header.c_str());
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+      curl_easy_setopt(curl, CURLOPT_POST, 1L);
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, query.c_str());
+      curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, query.size());
+      break;
+
     default:
       header = "Authorization: Bearer " + this->accessToken;
       headers = curl_slist_append(headers, header.c_str());
@@ -264,15 +636,502 @@ Request::sendRequest (const std::string & url,
       curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, query.size());
   }
 
+  return headers;
+}
+
+
+/*
+ * Function to send a request and wait for it to complete.
+ * The request is sent through the async engine,
+ * so that concurrent callers share the multiplexed connections.
+ * On the engine threads, the request is instead sent on the
+ * pooled handle of the calling thread. So are the uploads from a Source,
+ * since reading the source may block (on a cache miss for example).
+ */
+void
+Request::perform (struct Transfer & t)
+{
+
+  bool done = false;
+  CURL * curl = NULL;
+  CURLcode resp;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+  struct Transfer * xfer = NULL;
+
+  pthread_mutex_lock(&engineLock);
+  if (this->engine == NULL) {
+    this->engine = new AsyncEngine(*this);
+  }
+
+  if (t.source == NULL &&
+      this->engine->isEngineThread() == false) {
+    xfer = new Transfer(t.url, t.type, t.query, t.headers, t.secret);
+    xfer->sink = t.sink;
+    xfer->done = [&] (struct Transfer & x) -> long {
+      pthread_mutex_lock(&lock);
+      t.ok = x.ok;
+      t.code = x.code;
+      t.resp.swap(x.resp);
+      t.error.swap(x.error);
+      t.attempts = x.attempts;
+      done = true;
+      pthread_cond_signal(&cond);
+      pthread_mutex_unlock(&lock);
+      return -1;
+    };
+    this->engine->submit(xfer);
+    pthread_mutex_unlock(&engineLock);
+
+    pthread_mutex_lock(&lock);
+    while (done == false) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+    return;
+  }
+  pthread_mutex_unlock(&engineLock);
+
+  // Check to see whether curl is installed,
+  // and working fine.
+  try {
+    if ((curl = getHandle()) == NULL) {
+      throw GDFSException("Unable to use curl library");
+    }
+  } catch (...) {
+    throw GDFSException("Install libcurl-devel package");
+  }
+
+  t.body = t.query;
+  t.slist = this->setupHandle(curl, t.url, t.type, t.body, t.secret, t.headers, &t.resp, t.source);
+  if (t.sink != NULL) {
+    setupSink(curl, t.sink);
+  }
+
   // Send the CURL request.
   resp = curl_easy_perform(curl);
-  if (resp != CURLE_OK) {
-    curl_slist_free_all(headers);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &t.code);
+  curl_slist_free_all(t.slist);
+  t.slist = NULL;
+  ++t.attempts;
+
+  t.ok = checkResult(t, resp);
+  if (t.ok == false) {
+    t.error = "Unable to make a request to " + t.url + ": " + curl_easy_strerror(resp);
+  }
+}
+
+
+/*
+ * Blocking request.
+ */
+std::string
+Request::sendRequest (const std::string & url,
+                      requestType reqType,
+                      std::string query,
+                      bool secret,
+                      std::string headers_)
+{
+
+  struct Transfer t(url, reqType, query, headers_, secret);
+
+  this->perform(t);
+  if (t.ok == false) {
+    throw GDFSException("Unable to make a request to " + url);
+  }
+
+  return t.resp;
+}
+
+
+/*
+ * Blocking upload of a request body pulled from source.
+ * The body is never held in memory as a whole.
+ * Returns the response (headers included, for UPLOAD).
+ */
+std::string
+Request::sendUpload (const std::string & url,
+                     requestType type,
+                     const std::string & headers_,
+                     struct Source & source)
+{
+
+  struct Transfer t(url, type, "", headers_);
+
+  t.source = &source;
+  this->perform(t);
+  if (t.ok == false) {
+    throw GDFSException("Unable to make a request to " + url);
+  }
+
+  return t.resp;
+}
+
+
+/*
+ * Blocking download of the bytes start to stop of a file.
+ * The data is written straight into iov, and never more than
+ * the length of the range.
+ * Returns the number of bytes written. If Drive returns an error,
+ * nothing is written and the body of the error is set in error.
+ */
+size_t
+Request::sendDownload (const std::string & url,
+                       off_t start,
+                       off_t stop,
+                       const struct iovec * iov,
+                       int iovcnt,
+                       std::string & error)
+{
+
+  std::string range = "Range: bytes=" + std::to_string(start) + "-" + std::to_string(stop);
+  struct Sink sink(iov, iovcnt, start, stop - start + 1);
+  struct Transfer t(url, DOWNLOAD, range);
+
+  t.sink = &sink;
+  this->perform(t);
+  if (t.ok == false) {
+    throw GDFSException("Unable to make a request to " + url);
+  }
+
+  error.swap(sink.error);
+  return (error.empty() ? sink.written : 0);
+}
+
+
+/*
+ * Asynchronous request.
+ * The engine takes the ownership of the transfer,
+ * and deletes it once its callback reports that it is done.
+ */
+void
+Request::sendAsync (struct Transfer * t,
+                    long delay)
+{
+  pthread_mutex_lock(&engineLock);
+  if (this->engine == NULL) {
+    this->engine = new AsyncEngine(*this);
+  }
+  this->engine->submit(t, delay);
+  pthread_mutex_unlock(&engineLock);
+}
+
+
+
+////////////////////////////////////////////////////////////////
+//                    ASYNC ENGINE FUNCTIONS                  //
+////////////////////////////////////////////////////////////////
+
+
+AsyncEngine::AsyncEngine (Request & req_,
+                          long maxConnections,
+                          long maxStreams) :
+  req(req_),
+  stop(false)
+{
+  pthread_once(&pool_once, pool_init);
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&doneCond, NULL);
+
+  this->multi = curl_multi_init();
+  if (this->multi == NULL) {
+    throw GDFSException("Unable to use curl library");
+  }
+
+  // Multiplex the requests as HTTP/2 streams, over a few connections.
+  curl_multi_setopt(this->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(this->multi, CURLMOPT_MAX_HOST_CONNECTIONS, maxConnections);
+  curl_multi_setopt(this->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, maxStreams);
+
+  pthread_create(&loopThread, NULL, runLoop, this);
+  pthread_create(&doneThread, NULL, runCompletions, this);
+}
+
+
+AsyncEngine::~AsyncEngine (void)
+{
+  pthread_mutex_lock(&lock);
+  this->stop = true;
+  pthread_cond_signal(&doneCond);
+  pthread_mutex_unlock(&lock);
+  curl_multi_wakeup(this->multi);
+
+  pthread_join(loopThread, NULL);
+  pthread_join(doneThread, NULL);
+
+  // Fail whatever did not complete through its callback,
+  // so that no caller is left waiting on it.
+  // The requests in flight were moved into pending by the loop thread.
+  for (auto it : this->timers) {
+    this->pending.emplace_back(it.second);
+  }
+  this->timers.clear();
+  for (auto t : this->pending) {
+    t->ok = false;
+    t->error = "Request to " + t->url + " aborted at shutdown";
+  }
+  this->completed.splice(this->completed.end(), this->pending);
+
+  while (this->completed.empty() == false) {
+    struct Transfer * t = this->completed.front();
+    this->completed.pop_front();
+    try {
+      if (t->done) {
+        t->done(*t);
+      }
+    } catch (...) {
+      Error("async request to %s: unhandled error in callback", t->url.c_str());
+    }
+    delete t;
+  }
+
+  for (auto curl : this->idle) {
     curl_easy_cleanup(curl);
-    throw GDFSException("Unable to make a request to " + new_url);
   }
-  curl_slist_free_all(headers);
-  curl_easy_cleanup(curl);
 
-  return buf;
+  curl_multi_cleanup(this->multi);
+  pthread_cond_destroy(&doneCond);
+  pthread_mutex_destroy(&lock);
+}
+
+
+/*
+ * Function to check whether the caller is one of the engine threads.
+ * Such callers must not wait on the engine.
+ */
+bool
+AsyncEngine::isEngineThread (void) const
+{
+  pthread_t self = pthread_self();
+  return (pthread_equal(self, loopThread) || pthread_equal(self, doneThread));
+}
+
+
+/*
+ * Function to queue a request into the engine.
+ * If delay is set, the request is sent only after delay ms.
+ */
+void
+AsyncEngine::submit (struct Transfer * t,
+                     long delay)
+{
+  pthread_mutex_lock(&lock);
+  if (delay > 0) {
+    this->timers.emplace(now_ms() + delay, t);
+  } else {
+    this->pending.emplace_back(t);
+  }
+  pthread_mutex_unlock(&lock);
+
+  curl_multi_wakeup(this->multi);
+}
+
+
+/*
+ * Function to add a request to the multi handle.
+ * Only called from the loop thread.
+ */
+void
+AsyncEngine::addTransfer (struct Transfer * t)
+{
+
+  CURL * curl = NULL;
+
+  if (this->idle.empty() == false) {
+    curl = this->idle.back();
+    this->idle.pop_back();
+    curl_easy_reset(curl);
+  } else {
+    curl = curl_easy_init();
+  }
+
+  t->ok = false;
+  t->code = 0;
+  t->resp.clear();
+  t->error.clear();
+
+  if (curl == NULL) {
+    t->error = "Unable to use curl library";
+    pthread_mutex_lock(&lock);
+    this->completed.emplace_back(t);
+    pthread_cond_signal(&doneCond);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  Request::initHandle(curl, true);
+
+  // The body is rebuilt on every attempt,
+  // since setupHandle() may append to it.
+  t->curl = curl;
+  t->body = t->query;
+  t->slist = this->req.setupHandle(curl, t->url, t->type, t->body,
+                                   t->secret, t->headers, &t->resp, t->source);
+  if (t->sink != NULL) {
+    Request::setupSink(curl, t->sink);
+  }
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, t);
+
+  curl_multi_add_handle(this->multi, curl);
+  this->active.emplace(t);
+}
+
+
+/*
+ * Function to hand over a completed request to the completion thread.
+ * Only called from the loop thread.
+ */
+void
+AsyncEngine::finishTransfer (CURL * curl,
+                             CURLcode result)
+{
+
+  long version = 0;
+  struct Transfer * t = NULL;
+
+  curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &t);
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &t->code);
+  curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+  curl_multi_remove_handle(this->multi, curl);
+  this->active.erase(t);
+
+  t->ok = Request::checkResult(*t, result);
+  if (t->ok == false) {
+    t->error = "Unable to make a request to " + t->url + ": " + curl_easy_strerror(result);
+  }
+  ++t->attempts;
+
+  if (t->ok) {
+    pthread_mutex_lock(&pool_stats_lock);
+    ++pool_stats.requests;
+    if (version == CURL_HTTP_VERSION_2_0) {
+      ++pool_stats.multiplexed;
+    }
+    pthread_mutex_unlock(&pool_stats_lock);
+  }
+
+  curl_slist_free_all(t->slist);
+  t->slist = NULL;
+  t->curl = NULL;
+  this->idle.emplace_back(curl);
+
+  pthread_mutex_lock(&lock);
+  this->completed.emplace_back(t);
+  pthread_cond_signal(&doneCond);
+  pthread_mutex_unlock(&lock);
+}
+
+
+void *
+AsyncEngine::runLoop (void * arg)
+{
+
+  AsyncEngine * obj = (AsyncEngine *) arg;
+  int running = 0;
+  int msgs = 0;
+  int timeout = 0;
+  uint64_t now;
+  CURLMsg * msg = NULL;
+  std::list <struct Transfer *> ready;
+
+  while (1) {
+    // Collect the new requests, and the retries that are due.
+    pthread_mutex_lock(&obj->lock);
+    if (obj->stop) {
+      pthread_mutex_unlock(&obj->lock);
+      break;
+    }
+    ready.splice(ready.end(), obj->pending);
+    now = now_ms();
+    while (obj->timers.empty() == false &&
+           obj->timers.begin()->first <= now) {
+      ready.emplace_back(obj->timers.begin()->second);
+      obj->timers.erase(obj->timers.begin());
+    }
+    timeout = 1000;
+    if (obj->timers.empty() == false) {
+      timeout = std::min((uint64_t) timeout, obj->timers.begin()->first - now);
+    }
+    pthread_mutex_unlock(&obj->lock);
+
+    while (ready.empty() == false) {
+      obj->addTransfer(ready.front());
+      ready.pop_front();
+    }
+
+    // Drive all the transfers.
+    curl_multi_perform(obj->multi, &running);
+
+    while ((msg = curl_multi_info_read(obj->multi, &msgs)) != NULL) {
+      if (msg->msg == CURLMSG_DONE) {
+        obj->finishTransfer(msg->easy_handle, msg->data.result);
+      }
+    }
+
+    // Wait for network activity, a new request or the next timer.
+    curl_multi_poll(obj->multi, NULL, 0, timeout, NULL);
+  }
+
+  // Abort the requests still in flight.
+  // They are failed by the destructor, along with the pending ones.
+  pthread_mutex_lock(&obj->lock);
+  for (auto t : obj->active) {
+    curl_multi_remove_handle(obj->multi, t->curl);
+    curl_easy_cleanup(t->curl);
+    curl_slist_free_all(t->slist);
+    t->curl = NULL;
+    t->slist = NULL;
+    obj->pending.emplace_back(t);
+  }
+  obj->active.clear();
+  pthread_mutex_unlock(&obj->lock);
+
+  return NULL;
+}
+
+
+void *
+AsyncEngine::runCompletions (void * arg)
+{
+
+  AsyncEngine * obj = (AsyncEngine *) arg;
+  struct Transfer * t = NULL;
+  long delay = -1;
+
+  while (1) {
+    pthread_mutex_lock(&obj->lock);
+    while (obj->completed.empty() && obj->stop == false) {
+      pthread_cond_wait(&obj->doneCond, &obj->lock);
+    }
+    if (obj->stop) {
+      pthread_mutex_unlock(&obj->lock);
+      break;
+    }
+    t = obj->completed.front();
+    obj->completed.pop_front();
+    pthread_mutex_unlock(&obj->lock);
+
+    delay = -1;
+    try {
+      if (t->done) {
+        delay = t->done(*t);
+      }
+    } catch (...) {
+      Error("async request to %s: unhandled error in callback", t->url.c_str());
+      delay = -1;
+    }
+
+    // Retry after the delay requested by the callback.
+    if (delay >= 0) {
+      obj->submit(t, delay);
+    } else {
+      delete t;
+    }
+  }
+
+  return NULL;
 }
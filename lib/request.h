@@ -39,6 +39,19 @@
 #define REQUEST_H__
 
 #include <string>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <functional>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <curl/curl.h>
+
+#include "conf.h"
 
 
 struct AuthObj {
@@ -58,6 +71,207 @@ enum requestType {
   UPLOAD_SESSION,
   UPLOAD,
   GENERATE_ID,
+  BATCH,
+  MULTIPART_INSERT,
+  MULTIPART_UPDATE,
+};
+
+
+// Counters of the curl handle pool.
+// A hit is a request that reused a live handle of the calling thread,
+// a miss is a request that had to create a new one.
+// Requests counts the requests completed by the async engine,
+// of which multiplexed were sent as HTTP/2 streams.
+struct PoolStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t requests;
+  uint64_t multiplexed;
+};
+
+
+// Destination of a download.
+// The body of the response is written straight into the iovec,
+// upto the expected length asked for in the Range header.
+// If the server ignores the Range header, the bytes before start
+// are skipped. The body of an error response is kept in error instead.
+struct Sink {
+  const struct iovec * iov;
+  int iovcnt;
+  size_t start;
+  size_t expected;
+  size_t written;
+  long code;
+  std::string error;
+
+  // Private to the write callback.
+  CURL * curl;
+  int index;
+  size_t offset;
+  size_t skipped;
+
+  Sink (const struct iovec * iov_,
+        int iovcnt_,
+        size_t start_,
+        size_t expected_) :
+    iov(iov_),
+    iovcnt(iovcnt_),
+    start(start_),
+    expected(expected_),
+    written(0),
+    code(0),
+    curl(NULL),
+    index(0),
+    offset(0),
+    skipped(0) {};
+};
+
+
+// Called to read the next piece of the body of an upload,
+// of len bytes at offset. Returns the number of bytes read into buf.
+typedef std::function <size_t (char * buf, off_t offset, size_t len)> SourceCallback;
+
+
+// Source of an upload.
+// The body of the request is the length bytes from start,
+// pulled through read() in pieces as curl sends them.
+struct Source {
+  off_t start;
+  size_t length;
+  SourceCallback read;
+
+  // Private to the read callback.
+  size_t sent;
+
+  Source (off_t start_,
+          size_t length_,
+          SourceCallback read_) :
+    start(start_),
+    length(length_),
+    read(read_),
+    sent(0) {};
+};
+
+
+struct Transfer;
+
+// Called once an asynchronous request has completed.
+// Returns the delay (in ms) after which the request shall be sent again,
+// or a negative value if the request is done.
+typedef std::function <long (struct Transfer &)> TransferCallback;
+
+
+// An asynchronous request.
+struct Transfer {
+  std::string url;
+  requestType type;
+  std::string query;
+  bool secret;
+  std::string headers;
+  TransferCallback done;
+  struct Sink * sink;
+  struct Source * source;
+
+  // Filled in once the request has completed.
+  bool ok;
+  long code;
+  std::string resp;
+  std::string error;
+  int attempts;
+
+  // Private to the engine.
+  CURL * curl;
+  struct curl_slist * slist;
+  std::string body;
+
+  Transfer (const std::string & url_,
+            requestType type_,
+            const std::string & query_ = "",
+            const std::string & headers_ = "",
+            bool secret_ = false) :
+    url(url_),
+    type(type_),
+    query(query_),
+    secret(secret_),
+    headers(headers_),
+    sink(NULL),
+    source(NULL),
+    ok(false),
+    code(0),
+    attempts(0),
+    curl(NULL),
+    slist(NULL) {};
+};
+
+
+class Request;
+
+
+/*
+ * Event driven HTTP engine.
+ * A single thread runs the curl multi loop, keeping any number of
+ * requests in flight. Completed requests are handed to a second thread,
+ * which runs their callbacks, so that a slow callback never stalls
+ * the network.
+ * Requests to the same host are multiplexed as HTTP/2 streams, over
+ * at most maxConnections connections carrying upto maxStreams streams each.
+ */
+class AsyncEngine {
+
+  private:
+
+    Request & req;
+
+    CURLM * multi;
+
+    bool stop;
+
+    pthread_t loopThread;
+
+    pthread_t doneThread;
+
+    pthread_mutex_t lock;
+
+    pthread_cond_t doneCond;
+
+    std::list <struct Transfer *> pending;
+
+    std::list <struct Transfer *> completed;
+
+    std::multimap <uint64_t, struct Transfer *> timers;
+
+    std::set <struct Transfer *> active;
+
+    std::vector <CURL *> idle;
+
+    static void *
+    runLoop (void * arg);
+
+    static void *
+    runCompletions (void * arg);
+
+    void
+    addTransfer (struct Transfer * t);
+
+    void
+    finishTransfer (CURL * curl,
+                    CURLcode result);
+
+  public:
+
+    AsyncEngine (Request & req_,
+                 long maxConnections = GDFS_MAX_HOST_CONNECTIONS,
+                 long maxStreams = GDFS_MAX_CONCURRENT_STREAMS);
+
+    ~AsyncEngine (void);
+
+    bool
+    isEngineThread (void) const;
+
+    void
+    submit (struct Transfer * t,
+            long delay = 0);
+
 };
 
 
@@ -79,6 +293,16 @@ class Request {
 
     time_t expiresIn;
 
+    AsyncEngine * engine;
+
+    pthread_mutex_t engineLock;
+
+    static CURL *
+    getHandle (void);
+
+    void
+    perform (struct Transfer & t);
+
   public:
 
     Request (void);
@@ -114,12 +338,76 @@ class Request {
                    size_t nmemb,
                    void * userp);
 
+    static size_t
+    sinkCallback (void * contents,
+                  size_t size,
+                  size_t nmemb,
+                  void * userp);
+
+    static void
+    initHandle (CURL * curl,
+                bool multiplex = false);
+
+    static size_t
+    sourceCallback (char * buffer,
+                    size_t size,
+                    size_t nitems,
+                    void * userp);
+
+    static int
+    seekCallback (void * userp,
+                  curl_off_t offset,
+                  int origin);
+
+    static void
+    setupSink (CURL * curl,
+               struct Sink * sink);
+
+    static void
+    setupSource (CURL * curl,
+                 struct Source * source);
+
+    static bool
+    checkResult (struct Transfer & t,
+                 CURLcode result);
+
+    struct curl_slist *
+    setupHandle (CURL * curl,
+                 const std::string & url,
+                 requestType type,
+                 std::string & query,
+                 bool secret,
+                 const std::string & headers_,
+                 std::string * buf,
+                 struct Source * source = NULL);
+
     std::string
     sendRequest (const std::string & url,
                  requestType type,
                  std::string query = "",
                  bool secret = false,
                  std::string headers_ = "");
+
+    std::string
+    sendUpload (const std::string & url,
+                requestType type,
+                const std::string & headers_,
+                struct Source & source);
+
+    size_t
+    sendDownload (const std::string & url,
+                  off_t start,
+                  off_t stop,
+                  const struct iovec * iov,
+                  int iovcnt,
+                  std::string & error);
+
+    void
+    sendAsync (struct Transfer * t,
+               long delay = 0);
+
+    static void
+    getPoolStats (PoolStats & stats);
 };
 
 #endif // REQUEST_H__
@@ -0,0 +1,300 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+#include <algorithm>
+
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+#include "log.h"
+
+
+// Regions are aligned to huge pages, so that the kernel can back
+// them with transparent huge pages.
+#define GDFS_SLAB_HUGE_PAGE_SIZE 2097152
+
+
+SlabAllocator slab;
+
+
+SlabAllocator::SlabAllocator (void) :
+  region(NULL),
+  region_left(0),
+  allocs(0),
+  splits(0)
+{
+  pthread_mutex_init(&region_lock, NULL);
+
+  for (unsigned c = 0; c < GDFS_SLAB_CLASSES; ++c) {
+    pthread_mutex_init(&classes[c].lock, NULL);
+    classes[c].free = NULL;
+    classes[c].nfree = 0;
+    classes[c].nused = 0;
+  }
+}
+
+
+/*
+ * Function to find the smallest size class
+ * that can hold len bytes.
+ */
+unsigned
+SlabAllocator::class_of (size_t len) const
+{
+  unsigned c = 0;
+
+  while (((size_t) GDFS_SLAB_MIN_SIZE << c) < len) {
+    ++c;
+  }
+
+  return c;
+}
+
+
+/*
+ * Function to round len bytes up to its size class.
+ */
+size_t
+SlabAllocator::round (size_t len) const
+{
+  return (size_t) GDFS_SLAB_MIN_SIZE << this->class_of(len);
+}
+
+
+void
+SlabAllocator::push (unsigned c,
+                     char * mem)
+{
+  struct SlabChunk * chunk = (struct SlabChunk *) mem;
+
+  pthread_mutex_lock(&classes[c].lock);
+  chunk->next = classes[c].free;
+  classes[c].free = chunk;
+  ++classes[c].nfree;
+  pthread_mutex_unlock(&classes[c].lock);
+}
+
+
+char *
+SlabAllocator::pop (unsigned c)
+{
+  struct SlabChunk * chunk = NULL;
+
+  pthread_mutex_lock(&classes[c].lock);
+  chunk = classes[c].free;
+  if (chunk != NULL) {
+    classes[c].free = chunk->next;
+    --classes[c].nfree;
+  }
+  pthread_mutex_unlock(&classes[c].lock);
+
+  return (char *) chunk;
+}
+
+
+/*
+ * Function to map a new region, aligned to a huge page.
+ * The region lock must be held.
+ */
+char *
+SlabAllocator::map_region (void)
+{
+
+  size_t len = GDFS_SLAB_REGION_SIZE + GDFS_SLAB_HUGE_PAGE_SIZE;
+  char * m = NULL;
+  char * r = NULL;
+
+  m = (char *) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED) {
+    Error("Unable to map %zu bytes for the cache: %s", len, strerror(errno));
+    return NULL;
+  }
+
+  // Trim the extra bytes on either side of the aligned region.
+  r = (char *) (((uintptr_t) m + GDFS_SLAB_HUGE_PAGE_SIZE - 1) & ~((uintptr_t) GDFS_SLAB_HUGE_PAGE_SIZE - 1));
+  if (r > m) {
+    munmap(m, r - m);
+  }
+  if (m + len > r + GDFS_SLAB_REGION_SIZE) {
+    munmap(r + GDFS_SLAB_REGION_SIZE, (m + len) - (r + GDFS_SLAB_REGION_SIZE));
+  }
+
+#ifdef MADV_HUGEPAGE
+  madvise(r, GDFS_SLAB_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+
+  this->regions.push_back(r);
+  return r;
+}
+
+
+/*
+ * Function to carve a chunk of size class c from the current region.
+ * Once the region runs out, what is left of it is split into the
+ * free lists, and a new region is mapped.
+ */
+char *
+SlabAllocator::carve (unsigned c)
+{
+
+  size_t len = (size_t) GDFS_SLAB_MIN_SIZE << c;
+  size_t piece = 0;
+  char * mem = NULL;
+
+  pthread_mutex_lock(&region_lock);
+
+  if (this->region_left < len) {
+    for (int k = GDFS_SLAB_CLASSES - 1; k >= 0 && this->region_left > 0; --k) {
+      piece = (size_t) GDFS_SLAB_MIN_SIZE << k;
+      while (this->region_left >= piece) {
+        this->push(k, this->region);
+        this->region += piece;
+        this->region_left -= piece;
+      }
+    }
+
+    this->region = this->map_region();
+    this->region_left = (this->region != NULL) ? GDFS_SLAB_REGION_SIZE : 0;
+  }
+
+  if (this->region != NULL) {
+    mem = this->region;
+    this->region += len;
+    this->region_left -= len;
+  }
+
+  pthread_mutex_unlock(&region_lock);
+
+  return mem;
+}
+
+
+/*
+ * Function to allocate a chunk that can hold len bytes,
+ * of atmost GDFS_SLAB_MAX_SIZE.
+ * Returns NULL if no memory could be mapped.
+ */
+char *
+SlabAllocator::alloc (size_t len)
+{
+
+  unsigned c = this->class_of(len);
+  char * mem = NULL;
+
+  // Reuse a free chunk of the same size.
+  mem = this->pop(c);
+
+  // Split the smallest larger free chunk,
+  // leaving one chunk of every size in between free.
+  for (unsigned k = c + 1; mem == NULL && k < GDFS_SLAB_CLASSES; ++k) {
+    mem = this->pop(k);
+    if (mem != NULL) {
+      for (unsigned j = c; j < k; ++j) {
+        this->push(j, mem + ((size_t) GDFS_SLAB_MIN_SIZE << j));
+      }
+      ++this->splits;
+    }
+  }
+
+  if (mem == NULL) {
+    mem = this->carve(c);
+  }
+
+  if (mem != NULL) {
+    pthread_mutex_lock(&classes[c].lock);
+    ++classes[c].nused;
+    pthread_mutex_unlock(&classes[c].lock);
+    ++this->allocs;
+  }
+
+  return mem;
+}
+
+
+/*
+ * Function to give back a chunk allocated for len bytes.
+ */
+void
+SlabAllocator::free (char * mem,
+                     size_t len)
+{
+  unsigned c = 0;
+
+  if (mem == NULL) {
+    return;
+  }
+
+  c = this->class_of(len);
+
+  pthread_mutex_lock(&classes[c].lock);
+  --classes[c].nused;
+  pthread_mutex_unlock(&classes[c].lock);
+
+  this->push(c, mem);
+}
+
+
+/*
+ * Function to get the occupancy of the regions.
+ * The idle bytes are free for reuse, but only by their own size class,
+ * or the smaller ones.
+ */
+void
+SlabAllocator::get_stats (struct SlabStats & stats)
+{
+  size_t len = 0;
+
+  stats = SlabStats();
+
+  pthread_mutex_lock(&region_lock);
+  stats.regions = this->regions.size();
+  stats.mapped = stats.regions * GDFS_SLAB_REGION_SIZE;
+  pthread_mutex_unlock(&region_lock);
+
+  for (unsigned c = 0; c < GDFS_SLAB_CLASSES; ++c) {
+    len = (size_t) GDFS_SLAB_MIN_SIZE << c;
+    pthread_mutex_lock(&classes[c].lock);
+    stats.used += classes[c].nused * len;
+    stats.idle += classes[c].nfree * len;
+    pthread_mutex_unlock(&classes[c].lock);
+  }
+
+  stats.allocs = this->allocs;
+  stats.splits = this->splits;
+}
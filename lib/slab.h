@@ -0,0 +1,150 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+#ifndef SLAB_H__
+#define SLAB_H__
+
+
+#include <atomic>
+#include <vector>
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "conf.h"
+
+
+/***********************************************/
+/*         SLAB ALLOCATOR FOR THE CACHE        */
+/*                                             */
+/***********************************************/
+
+
+// Size classes of the slab allocator,
+// powers of two from GDFS_SLAB_MIN_SIZE upto GDFS_SLAB_MAX_SIZE.
+#define GDFS_SLAB_MIN_SIZE 4096
+#define GDFS_SLAB_MAX_SIZE GDFS_CACHE_BLOCK_SIZE
+#define GDFS_SLAB_CLASSES 16
+
+static_assert((GDFS_SLAB_MAX_SIZE & (GDFS_SLAB_MAX_SIZE - 1)) == 0 &&
+              GDFS_SLAB_MAX_SIZE >= GDFS_SLAB_MIN_SIZE &&
+              GDFS_SLAB_MAX_SIZE <= ((size_t) GDFS_SLAB_MIN_SIZE << (GDFS_SLAB_CLASSES - 1)),
+              "slab max size must be a power of two within the size classes");
+
+static_assert(GDFS_SLAB_REGION_SIZE % GDFS_SLAB_MAX_SIZE == 0,
+              "slab region size must be a multiple of the slab max size");
+
+
+// A free chunk, linked through its own memory.
+struct SlabChunk {
+  struct SlabChunk * next;
+};
+
+
+// Chunks of one size class that are free to be handed out.
+struct SlabClass {
+  pthread_mutex_t lock;
+  struct SlabChunk * free;
+  uint64_t nfree;
+  uint64_t nused;
+};
+
+
+struct SlabStats {
+  uint64_t regions;
+  uint64_t mapped;
+  uint64_t used;
+  uint64_t idle;
+  uint64_t allocs;
+  uint64_t splits;
+};
+
+
+// Allocator for the memory of the cache blocks.
+// Chunks are carved out of GDFS_SLAB_REGION_SIZE regions mapped
+// with huge page hints, and freed chunks are kept for reuse in the
+// free list of their size class, never going back to the system.
+// A size class with no free chunk splits one of a larger class,
+// before carving from the current region.
+class SlabAllocator {
+  private:
+    struct SlabClass classes[GDFS_SLAB_CLASSES];
+    pthread_mutex_t region_lock;
+    char * region;
+    size_t region_left;
+    std::vector <char *> regions;
+    std::atomic <uint64_t> allocs;
+    std::atomic <uint64_t> splits;
+
+    unsigned
+    class_of (size_t len) const;
+
+    void
+    push (unsigned c,
+          char * mem);
+
+    char *
+    pop (unsigned c);
+
+    char *
+    map_region (void);
+
+    char *
+    carve (unsigned c);
+
+  public:
+    SlabAllocator (void);
+
+    size_t
+    round (size_t len) const;
+
+    char *
+    alloc (size_t len);
+
+    void
+    free (char * mem,
+          size_t len);
+
+    void
+    get_stats (struct SlabStats & stats);
+};
+
+
+extern SlabAllocator slab;
+
+
+#endif // SLAB_H__
@@ -35,6 +35,8 @@
 
 
 #include <unordered_map>
+#include <map>
+#include <set>
 
 
 #include "threadpool.h"
@@ -64,107 +66,442 @@ gdfs_worker (void * arg)
 {
 
   class Threadpool * obj = (class Threadpool *) arg;
-  struct req_item new_item;
+
+  obj->dispatch();
+
+  return NULL;
+}
+
+
+/*
+ * Function to check whether a request can be sent as part of a batch.
+ * Only the metadata requests can be batched.
+ */
+static bool
+is_batchable (const struct req_item & item)
+{
+  switch (item.req_type) {
+    case GET:
+    case UPDATE:
+    case INSERT:
+    case DELETE:
+      return (item.node != NULL);
+
+    default:
+      return false;
+  }
+}
+
+
+/*
+ * Function to hand over the queued requests to the HTTP engine,
+ * as long as the number of requests in flight is within limits.
+ */
+void
+Threadpool::dispatch (void)
+{
+
+  struct req_item item;
+  std::vector <struct req_item> batch;
 
   while (1) {
     // Wait until there is a request to be sent.
     int ret = sem_wait (&req_item_sem);
     if (ret == -1 && errno == EINTR) {
-      pthread_mutex_lock(&worker_lock);
-      if (obj->kill_workers == true) {
-        pthread_mutex_unlock(&worker_lock);
-        break;
-      }
-      pthread_mutex_unlock(&worker_lock);
       continue;
     }
 
-    // Get the item to be processed.
-    struct req_item item;
+    // Wait for a free slot.
     pthread_mutex_lock(&worker_lock);
-    if (req_queue.empty() == false) {
-      item = req_queue.front();
-      req_queue.pop_front();
+    while (this->active_requests >= GDFS_MAX_INFLIGHT_REQUESTS &&
+           this->kill_workers == false) {
+      pthread_cond_wait(&active_cond, &worker_lock);
+    }
+    if (this->kill_workers == true) {
+      pthread_mutex_unlock(&worker_lock);
+      break;
     }
-    pthread_mutex_unlock(&worker_lock);
 
-    // Check whether the request has failed.
-    // If yes, add it back to the request queue.
-    if (obj->send_request(item) == false) {
-      new_item.id       = item.id;
-      new_item.req_type = item.req_type;
-      new_item.url      = item.url;
-      new_item.query    = item.query;
-      new_item.node     = item.node;
-      pthread_mutex_lock(&worker_lock);
-      req_queue.emplace_front(new_item);
-      sem_post(&req_item_sem);
+    // Get the item to be processed.
+    if (req_queue.empty() == true) {
       pthread_mutex_unlock(&worker_lock);
+      continue;
     }
-  }
+    item = req_queue.front();
+    req_queue.pop_front();
+
+    // Batch it along with the requests following it, if possible.
+    batch.clear();
+    if (is_batchable(item)) {
+      batch.emplace_back(item);
+      this->collect_batch(batch);
+    }
+    this->active_requests += (batch.size() > 1 ? batch.size() : 1);
+    pthread_mutex_unlock(&worker_lock);
 
-  return NULL;
+    if (batch.size() > 1) {
+      this->send_batch(batch);
+    } else {
+      this->send_request(item);
+    }
+  }
 }
 
 
-bool
-Threadpool::send_request (struct req_item & item)
+/*
+ * Function to move the requests following the first request of the batch
+ * from the request queue into the batch.
+ * The parts of a batch may be processed in any order by Drive,
+ * so a request is not batched if it depends on a request already
+ * in the batch (same file, or a parent/child of it).
+ * Must be called with worker_lock held.
+ */
+void
+Threadpool::collect_batch (std::vector <struct req_item> & batch)
 {
 
-  Debug("<-- Entering send_request() -->");
+  std::set <std::string> ids;
+  std::set <std::string> parent_ids;
+  std::string parent_id;
 
-  bool ret = false;
+  auto get_parent_id = [](const struct req_item & item) -> std::string {
+    if (item.node->parent != NULL && item.node->parent->entry != NULL) {
+      return item.node->parent->entry->file_id;
+    }
+    return std::string();
+  };
 
-  switch (item.req_type) {
-    case GET:
-      ret = send_get_req(item.url, item.node);
-      break;
+  ids.emplace(batch.front().id);
+  parent_ids.emplace(get_parent_id(batch.front()));
 
-    case UPDATE:
-      ret = send_update_req(item.url, item.query, item.node->entry);
+  while (req_queue.empty() == false &&
+         batch.size() < GDFS_BATCH_MAX_REQUESTS) {
+    struct req_item & item = req_queue.front();
+    if (is_batchable(item) == false) {
       break;
+    }
 
-    case INSERT:
-      ret = send_insert_req(item.url, item.query, item.node->entry);
+    parent_id = get_parent_id(item);
+    if (ids.count(item.id) ||
+        ids.count(parent_id) ||
+        parent_ids.count(item.id)) {
       break;
+    }
+    ids.emplace(item.id);
+    parent_ids.emplace(parent_id);
 
-    case DELETE:
-      ret = send_delete_req(item.url, item.node);
-      break;
+    batch.emplace_back(item);
+    req_queue.pop_front();
 
-    case GENERATE_ID:
-      ret = send_generate_id_req(item.url);
-      break;
+    // The semaphore was posted for this request too.
+    sem_trywait(&req_item_sem);
+  }
+}
 
-    case UPLOAD:
-      ret = send_upload_req(item.url, item.query, item.headers);
-      break;
+
+/*
+ * Function to send a request from the request queue asynchronously.
+ * The response is handled by complete_request().
+ */
+void
+Threadpool::send_request (struct req_item & item,
+                          long delay)
+{
+
+  Debug("<-- Entering send_request() -->");
+
+  struct Transfer * t = NULL;
+  struct req_item req = item;
+
+  t = new Transfer(item.url, item.req_type, item.query, item.headers);
+  assert(t != NULL);
+  t->done = [this, req] (struct Transfer & xfer) mutable -> long {
+    return this->complete_request(req, xfer);
+  };
+
+  try {
+    this->auth.sendAsync(t, delay);
+  } catch (GDFSException & err) {
+    Error("%s", err.get().c_str());
+    t->error = err.get();
+    this->complete_request(req, *t);
+    delete t;
   }
 
   Debug("<-- Exiting send_request() -->");
-  return ret;
 }
 
 
-bool
-Threadpool::send_get_req (const std::string & url,
+/*
+ * Function to send a batch of requests from the request queue,
+ * as a single multipart/mixed request.
+ * The response is handled by complete_batch().
+ */
+void
+Threadpool::send_batch (std::vector <struct req_item> & batch)
+{
+
+  Debug("<-- Entering send_batch() -->");
+
+  struct Transfer * t = NULL;
+  std::vector <struct req_item> items = batch;
+  std::string boundary = "gdfs_batch_" + rand_str();
+  std::string body;
+  std::string path;
+  std::string method;
+  std::string::size_type pos;
+
+  Debug("Sending a batch of %zu requests", batch.size());
+
+  for (unsigned i = 0; i < batch.size(); ++i) {
+    switch (batch[i].req_type) {
+      case GET:    method = "GET";    break;
+      case UPDATE: method = "PATCH";  break;
+      case INSERT: method = "POST";   break;
+      case DELETE: method = "DELETE"; break;
+      default:     break;
+    }
+
+    // Each part carries the path of the request, without the host.
+    pos = batch[i].url.find("://");
+    pos = batch[i].url.find('/', pos == std::string::npos ? 0 : pos + 3);
+    path = (pos == std::string::npos ? "/" : batch[i].url.substr(pos));
+
+    body += "--" + boundary + "\r\n";
+    body += "Content-Type: application/http\r\n";
+    body += "Content-ID: <item-" + std::to_string(i) + ">\r\n\r\n";
+    body += method + " " + path + "\r\n";
+    if (batch[i].query.empty() == false) {
+      body += "Content-Type: application/json; charset=UTF-8\r\n\r\n";
+      body += batch[i].query + "\r\n";
+    } else {
+      body += "\r\n";
+    }
+  }
+  body += "--" + boundary + "--\r\n";
+
+  t = new Transfer(GDFS_BATCH_URL, BATCH, body,
+                   "Content-Type: multipart/mixed; boundary=" + boundary);
+  assert(t != NULL);
+  t->done = [this, items] (struct Transfer & xfer) mutable -> long {
+    this->complete_batch(items, xfer);
+    return -1;
+  };
+
+  try {
+    this->auth.sendAsync(t);
+  } catch (GDFSException & err) {
+    Error("%s", err.get().c_str());
+    t->error = err.get();
+    this->complete_batch(items, *t);
+    delete t;
+  }
+
+  Debug("<-- Exiting send_batch() -->");
+}
+
+
+/*
+ * Function to split the response of a batch request into its parts.
+ * Every part is returned as the HTTP status code and body of the
+ * response, indexed by the Content-ID of the request.
+ */
+static bool
+parse_batch (const std::string & resp,
+             std::map <unsigned, std::pair <long, std::string> > & parts)
+{
+
+  std::string boundary;
+  std::string part;
+  std::string::size_type start;
+  std::string::size_type end;
+  std::string::size_type pos;
+  unsigned index;
+  long code;
+
+  // The boundary of the response is its first line.
+  if (resp.compare(0, 2, "--") != 0) {
+    return false;
+  }
+  end = resp.find_first_of("\r\n");
+  if (end == std::string::npos) {
+    return false;
+  }
+  boundary = resp.substr(0, end);
+
+  start = end;
+  while ((end = resp.find(boundary, start)) != std::string::npos) {
+    part = resp.substr(start, end - start);
+    start = end + boundary.size();
+
+    // Content-ID: <response-item-N>
+    pos = part.find("response-item-");
+    if (pos == std::string::npos) {
+      continue;
+    }
+    index = strtoul(part.c_str() + pos + 14, NULL, 10);
+
+    // Status line of the response.
+    pos = part.find("HTTP/", pos);
+    if (pos == std::string::npos ||
+        sscanf(part.c_str() + pos, "HTTP/%*s %ld", &code) != 1) {
+      continue;
+    }
+
+    // Body of the response, after the headers.
+    pos = part.find("\r\n\r\n", pos);
+    if (pos == std::string::npos) {
+      parts[index] = std::make_pair(code, std::string());
+      continue;
+    }
+    part = part.substr(pos + 4);
+    while (part.empty() == false &&
+           (part.back() == '\n' || part.back() == '\r')) {
+      part.pop_back();
+    }
+    parts[index] = std::make_pair(code, part);
+  }
+
+  return true;
+}
+
+
+/*
+ * Function called once a batch request has completed.
+ * The response of every part is handled as that of its own request.
+ * Parts that failed or are missing are sent again individually.
+ */
+void
+Threadpool::complete_batch (std::vector <struct req_item> & batch,
+                            struct Transfer & t)
+{
+
+  Debug("<-- Entering complete_batch() -->");
+
+  long delay = -1;
+  std::map <unsigned, std::pair <long, std::string> > parts;
+  std::map <unsigned, std::pair <long, std::string> >::iterator it;
+
+  if (t.ok == false) {
+    Error("%s", t.error.c_str());
+  } else if (t.code != 200 || parse_batch(t.resp, parts) == false) {
+    Error("batch request failed with HTTP code %ld", t.code);
+    parts.clear();
+  }
+
+  for (unsigned i = 0; i < batch.size(); ++i) {
+    it = parts.find(i);
+    if (it == parts.end()) {
+      this->send_request(batch[i]);
+      continue;
+    }
+
+    struct Transfer part(batch[i].url, batch[i].req_type);
+    part.ok = true;
+    part.code = it->second.first;
+    part.resp = it->second.second;
+    part.attempts = 1;
+
+    delay = this->complete_request(batch[i], part);
+    if (delay >= 0) {
+      this->send_request(batch[i], delay);
+    }
+  }
+
+  Debug("<-- Exiting complete_batch() -->");
+}
+
+
+/*
+ * Function called once a request has completed.
+ * Returns the delay after which the request is to be retried,
+ * or -1 if its done.
+ */
+long
+Threadpool::complete_request (struct req_item & item,
+                              struct Transfer & t)
+{
+
+  Debug("<-- Entering complete_request() -->");
+
+  long delay = -1;
+  responseStatus ret = RESP_ERROR;
+
+  if (t.ok == false) {
+    Error("%s", t.error.c_str());
+  } else {
+    switch (item.req_type) {
+      case GET:
+        ret = send_get_req(t.resp, item.node);
+        break;
+
+      case UPDATE:
+        ret = send_update_req(t.resp, item.node->entry);
+        break;
+
+      case INSERT:
+        ret = send_insert_req(t.resp, item.node->entry, t.attempts);
+        break;
+
+      case DELETE:
+        ret = send_delete_req(t.resp, item.node);
+        break;
+
+      case GENERATE_ID:
+        ret = send_generate_id_req(t.resp);
+        break;
+
+      case UPLOAD:
+        ret = send_upload_req(t.resp);
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  pthread_mutex_lock(&worker_lock);
+
+  // Retry the request after a while.
+  if (ret == RESP_RETRY && this->kill_workers == false) {
+    delay = GDFS_RETRY_DELAY;
+    goto out;
+  }
+
+  // Check whether the request has failed.
+  // If yes, add it back to the request queue.
+  if (ret != RESP_OK && this->kill_workers == false) {
+    req_queue.emplace_front(item);
+    sem_post(&req_item_sem);
+  }
+
+  --this->active_requests;
+  pthread_cond_broadcast(&active_cond);
+
+out:
+  pthread_mutex_unlock(&worker_lock);
+
+  Debug("<-- Exiting complete_request() -->");
+  return delay;
+}
+
+
+responseStatus
+Threadpool::send_get_req (const std::string & resp,
                           struct GDFSNode * node)
 {
 
   Debug("<-- Entering send_get_req() -->");
 
-  bool ret = false;
+  responseStatus ret = RESP_ERROR;
   bool json_parsed = true;
   time_t time_;
   json::Value val;
-  std::string resp;
   std::string error;
   std::string file_name;
   struct GDFSEntry * entry = node->entry;
 
-retry:
   try {
-    resp = this->auth.sendRequest(url, GET);
     val.parse(resp);
   } catch (GDFSException & err) {
     error = err.get();
@@ -183,7 +520,7 @@ retry:
 
   if (time_ <= entry->mtime) {
     Debug("File %s not modified. Nothing to do", node->file_name.c_str());
-    ret = true;
+    ret = RESP_OK;
     goto out;
   } else if (entry->g_doc && entry->mtime < time_) {
     gdi->download_file(node);
@@ -211,15 +548,15 @@ retry:
   }
   entry->cached_time = time(NULL);
 
-  ret = true;
+  ret = RESP_OK;
 
 out:
-  if (ret == false) {
+  if (ret != RESP_OK) {
     if (json_parsed && val["error"]["code"].get() == "403") {
-      sleep(1);
-      goto retry;
+      ret = RESP_RETRY;
+    } else {
+      Error("%s", error.c_str());
     }
-    Error("%s", error.c_str());
   }
 
   Debug("<-- Exiting send_get_req() -->");
@@ -227,26 +564,21 @@ out:
 }
 
 
-bool
-Threadpool::send_insert_req (std::string & url,
-                             std::string & query,
-                             struct GDFSEntry * entry)
+responseStatus
+Threadpool::send_insert_req (const std::string & resp,
+                             struct GDFSEntry * entry,
+                             int attempts)
 {
 
   Debug("<-- Entering send_insert_req() -->");
 
-  bool ret = false;
+  responseStatus ret = RESP_ERROR;
   bool json_parsed = false;
   json::Value val;
   std::string error;
   time_t mtime;
-  std::string resp;
-  int count = 0;
 
-retry:
   try {
-    val.clear();
-    resp = this->auth.sendRequest(url, INSERT, query);
     val.parse(resp);
   } catch (GDFSException & err) {
     error = err.get();
@@ -260,7 +592,7 @@ retry:
     error += ", " + val["error"]["message"].get();
     goto out;
   } catch (GDFSException & err) {
-    ret = true;
+    ret = RESP_OK;
   }
 
   mtime = rfc3339_to_sec(val["modifiedTime"].get());
@@ -268,17 +600,14 @@ retry:
   entry->pending_create = false;
 
 out:
-  if (ret == false) {
-    if (json_parsed) {
-      if (val["error"]["code"].get() == "403") {
-        sleep(1);
-        goto retry;
-      } else if (++count < 5 && val["error"]["code"].get() == "404") {
-        sleep(1);
-        goto retry;
-      }
+  if (ret != RESP_OK) {
+    if (json_parsed &&
+        (val["error"]["code"].get() == "403" ||
+         (attempts < 5 && val["error"]["code"].get() == "404"))) {
+      ret = RESP_RETRY;
+    } else {
+      Error("%s", error.c_str());
     }
-    Error("%s", error.c_str());
   }
 
   Debug("<-- Exiting send_insert_req() -->");
@@ -286,24 +615,20 @@ out:
 }
 
 
-bool
-Threadpool::send_delete_req (std::string & url,
+responseStatus
+Threadpool::send_delete_req (const std::string & resp,
                              struct GDFSNode * node)
 {
 
   Debug("<-- Entering send_delete_req() -->");
 
-  bool ret = false;
+  responseStatus ret = RESP_ERROR;
   bool json_parsed = false;
   json::Value val;
-  std::string resp;
   std::string error;
   std::unordered_map <std::string, GDFSNode *>::iterator it_node;
 
-retry:
   try {
-    val.clear();
-    resp = this->auth.sendRequest(url, DELETE);
     val.parse(resp);
   } catch (GDFSException & err) {
     error = err.get();
@@ -317,7 +642,7 @@ retry:
     error += ", " + val["error"]["message"].get();
     goto out;
   } catch (GDFSException & err) {
-    ret = true;
+    ret = RESP_OK;
   }
 
   it_node = file_id_node.find(node->entry->file_id);
@@ -328,12 +653,12 @@ retry:
   node = NULL;
 
 out:
-  if (ret == false) {
+  if (ret != RESP_OK) {
     if (json_parsed && (val["error"]["code"].get() == "403" || val["error"]["code"].get() == "404")) {
-      sleep(1);
-      goto retry;
+      ret = RESP_RETRY;
+    } else {
+      Error("%s", error.c_str());
     }
-    Error("%s", error.c_str());
   }
 
   Debug("<-- Exiting send_delete_req() -->");
@@ -341,25 +666,20 @@ out:
 }
 
 
-bool
-Threadpool::send_update_req (std::string & url,
-                             std::string & query,
+responseStatus
+Threadpool::send_update_req (const std::string & resp,
                              struct GDFSEntry * entry)
 {
 
   Debug("<-- Entering send_update_req() -->");
 
-  bool ret = false;
+  responseStatus ret = RESP_ERROR;
   bool json_parsed = false;
   json::Value val;
   std::string error;
   time_t mtime;
-  std::string resp;
 
-retry:
   try {
-    val.clear();
-    resp = this->auth.sendRequest(url, UPDATE, query);
     val.parse(resp);
   } catch (GDFSException & err) {
     error = err.get();
@@ -372,7 +692,7 @@ retry:
     error += ", " + val["error"]["message"].get();
     goto out;
   } catch (GDFSException & err) {
-    ret = true;
+    ret = RESP_OK;
   }
 
   // Update the file entry.
@@ -380,12 +700,12 @@ retry:
   entry->mtime = entry->ctime = mtime;
 
 out:
-  if (ret == false) {
+  if (ret != RESP_OK) {
     if (json_parsed && val["error"]["code"].get() == "403") {
-      sleep(1);
-      goto retry;
+      ret = RESP_RETRY;
+    } else {
+      Error("%s", error.c_str());
     }
-    Error("%s", error.c_str());
   }
 
   Debug("<-- Exiting send_update_req() -->");
@@ -393,26 +713,23 @@ out:
 }
 
 
-bool
-Threadpool::send_generate_id_req (std::string & url)
+responseStatus
+Threadpool::send_generate_id_req (const std::string & resp)
 {
 
   Debug("<-- Entering send_generate_id_req() -->");
 
-  bool ret = false;
+  responseStatus ret = RESP_ERROR;
   bool json_parsed = true;
   json::Value val;
   std::string error;
-  std::string resp;
   std::vector <json::Value *> file_ids;
 
-retry:
   try {
-    val.clear();
-    resp = this->auth.sendRequest(url, GENERATE_ID);
     val.parse(resp);
   } catch (GDFSException & err) {
     error = err.get();
+    json_parsed = false;
     goto out;
   }
   json_parsed = true;
@@ -428,15 +745,15 @@ retry:
   for (unsigned i = 0; i < file_ids.size(); ++i) {
     file_id_q.emplace(file_ids[i]->get());
   }
-  ret = true;
+  ret = RESP_OK;
 
 out:
-  if (ret == false) {
+  if (ret != RESP_OK) {
     if (json_parsed && val["error"]["code"].get() == "403") {
-      sleep(1);
-      goto retry;
+      ret = RESP_RETRY;
+    } else {
+      Error("%s", error.c_str());
     }
-    Error("%s", error.c_str());
   }
 
   Debug("<-- Exiting send_generate_id_req() -->");
@@ -444,24 +761,18 @@ out:
 }
 
 
-bool
-Threadpool::send_upload_req (std::string & url,
-                             std::string & query,
-                             std::string & headers)
+responseStatus
+Threadpool::send_upload_req (const std::string & resp)
 {
 
   Debug("<-- Entering send_upload_req() -->");
 
-  bool ret = false;
+  responseStatus ret = RESP_ERROR;
   bool json_parsed = false;
   json::Value val;
   std::string error;
-  std::string resp;
 
-retry:
   try {
-    val.clear();
-    resp = this->auth.sendRequest(url, UPLOAD, query, false, headers);
     val.parse(resp);
   } catch (GDFSException & err) {
     error = err.get();
@@ -474,16 +785,16 @@ retry:
     error += ", " + val["error"]["message"].get();
     goto out;
   } catch (GDFSException & err) {
-    ret = true;
+    ret = RESP_OK;
   }
 
 out:
-  if (ret == false) {
+  if (ret != RESP_OK) {
     if (json_parsed && val["error"]["code"].get() == "403") {
-      sleep(1);
-      goto retry;
+      ret = RESP_RETRY;
+    } else {
+      Error("%s", error.c_str());
     }
-    Error("%s", error.c_str());
   }
 
   Debug("<-- Exiting send_upload_req() -->");
@@ -614,6 +925,40 @@ Threadpool::merge_requests (const std::string & a,
 }
 
 
+/*
+ * Function to take a request out of the request queue, before it is sent,
+ * so that the caller can send it along with its own request.
+ * Returns false if there is no such request waiting in the queue.
+ */
+bool
+Threadpool::take_request (const std::string & id,
+                          requestType request_type,
+                          struct req_item & item)
+{
+
+  Debug("<-- Entering take_request() -->");
+
+  bool ret = false;
+  std::list <req_item>::iterator it;
+
+  pthread_mutex_lock(&worker_lock);
+  it = std::find_if(req_queue.begin(), req_queue.end(),
+                    [&](const req_item & r)->bool { return r.id == id && r.req_type == request_type; });
+  if (it != req_queue.end()) {
+    item = *it;
+    req_queue.erase(it);
+
+    // The semaphore was posted for this request.
+    sem_trywait(&req_item_sem);
+    ret = true;
+  }
+  pthread_mutex_unlock(&worker_lock);
+
+  Debug("<-- Exiting take_request() -->");
+  return ret;
+}
+
+
 /*
  * Function to insert a request into the request queue.
  */
@@ -681,6 +1026,17 @@ Threadpool::build_request (const std::string & id,
           req_queue.emplace_back(item);
           sem_post(&req_item_sem);
           break;
+
+        case BATCH:
+          // Batches are only built by the workers, out of queued requests.
+          // They never show up in the request queue.
+          break;
+
+        case MULTIPART_INSERT:
+        case MULTIPART_UPDATE:
+          // Multipart uploads are sent by the write-back threads,
+          // they never go through the request queue.
+          break;
       }
 
     } else {
@@ -748,6 +1104,17 @@ Threadpool::build_request (const std::string & id,
             req_queue.emplace_back(item);
           }
           break;
+
+        case BATCH:
+          // Batches are only built by the workers, out of queued requests.
+          // They never show up in the request queue.
+          break;
+
+        case MULTIPART_INSERT:
+        case MULTIPART_UPDATE:
+          // Multipart uploads are sent by the write-back threads,
+          // they never go through the request queue.
+          break;
       }
     }
 
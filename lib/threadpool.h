@@ -43,6 +43,7 @@
 #include <string>
 #include <queue>
 #include <list>
+#include <vector>
 
 #include <pthread.h>
 #include <semaphore.h>
@@ -70,6 +71,14 @@ struct req_item {
 };
 
 
+// Result of handling the response to a request.
+enum responseStatus {
+  RESP_OK,
+  RESP_RETRY,
+  RESP_ERROR,
+};
+
+
 extern sem_t req_item_sem;
 extern pthread_mutex_t worker_lock;
 extern std::list <struct req_item> req_queue;
@@ -79,11 +88,21 @@ void * gdfs_worker (void * arg);
 
 class GDrive;
 
+/*
+ * The request queue is drained by a single dispatcher thread,
+ * which hands every request to the asynchronous HTTP engine.
+ * Upto GDFS_MAX_INFLIGHT_REQUESTS requests are in flight at any time,
+ * and the response of each request is handled by the send_*_req()
+ * functions once it completes.
+ * Consecutive metadata requests are sent together as a single
+ * Drive batch request, of upto GDFS_BATCH_MAX_REQUESTS requests.
+ */
 class Threadpool {
   private:
-    int active_threads;
-    int threads[GDFS_MAX_WORKER_THREADS];
-    pthread_t gdfs_workers[GDFS_MAX_WORKER_THREADS];
+    int active_requests;
+    int dispatcher;
+    pthread_t gdfs_dispatcher;
+    pthread_cond_t active_cond;
     Auth & auth;
     GDrive * gdi;
 
@@ -92,20 +111,16 @@ class Threadpool {
 
     Threadpool (GDrive * gdi_,
                 Auth & auth_) :
-      active_threads(0),
+      active_requests(0),
       auth(auth_),
       gdi(gdi_),
       kill_workers(false)
     {
       sem_init(&req_item_sem, 0, 0);
       pthread_mutex_init(&worker_lock, NULL);
+      pthread_cond_init(&active_cond, NULL);
 
-      for (int i = 0; i < GDFS_MAX_WORKER_THREADS; i++) {
-        this->threads[i] = pthread_create(&gdfs_workers[i], NULL, gdfs_worker, this);
-        if (this->threads[i] == 0) {
-          ++active_threads;
-        }
-      }
+      this->dispatcher = pthread_create(&gdfs_dispatcher, NULL, gdfs_worker, this);
     }
 
 
@@ -113,19 +128,29 @@ class Threadpool {
     {
       pthread_mutex_lock(&worker_lock);
       this->kill_workers = true;
+      pthread_cond_broadcast(&active_cond);
       pthread_mutex_unlock(&worker_lock);
+      sem_post(&req_item_sem);
+
+      if (this->dispatcher == 0) {
+        pthread_join(gdfs_dispatcher, NULL);
+      }
 
-      for (int i = 0; i < GDFS_MAX_WORKER_THREADS; i++) {
-        if (this->threads[i] == 0 && pthread_tryjoin_np(gdfs_workers[i], NULL) == EBUSY) {
-          pthread_cancel(gdfs_workers[i]);
-          pthread_join(gdfs_workers[i], NULL);
-        }
+      // Wait for the requests in flight to complete.
+      pthread_mutex_lock(&worker_lock);
+      while (this->active_requests > 0) {
+        pthread_cond_wait(&active_cond, &worker_lock);
       }
+      pthread_mutex_unlock(&worker_lock);
 
+      pthread_cond_destroy(&active_cond);
       pthread_mutex_destroy(&worker_lock);
       sem_destroy(&req_item_sem);
     }
 
+    void
+    dispatch (void);
+
     void
     build_request (const std::string & id,
                    requestType request_type,
@@ -139,33 +164,50 @@ class Threadpool {
                     const std::string & b) const;
 
     bool
-    send_request (struct req_item & item);
+    take_request (const std::string & id,
+                  requestType request_type,
+                  struct req_item & item);
 
-    bool
-    send_update_req (std::string & url,
-                     std::string & query,
+    void
+    collect_batch (std::vector <struct req_item> & batch);
+
+    void
+    send_request (struct req_item & item,
+                  long delay = 0);
+
+    void
+    send_batch (std::vector <struct req_item> & batch);
+
+    long
+    complete_request (struct req_item & item,
+                      struct Transfer & t);
+
+    void
+    complete_batch (std::vector <struct req_item> & batch,
+                    struct Transfer & t);
+
+    responseStatus
+    send_update_req (const std::string & resp,
                      struct GDFSEntry * entry);
 
-    bool
-    send_delete_req (std::string & url,
+    responseStatus
+    send_delete_req (const std::string & resp,
                      struct GDFSNode * node);
 
-    bool
-    send_insert_req (std::string & url,
-                     std::string & query, 
-                     struct GDFSEntry * entry);
+    responseStatus
+    send_insert_req (const std::string & resp,
+                     struct GDFSEntry * entry,
+                     int attempts);
 
-    bool
-    send_get_req (const std::string & url,
+    responseStatus
+    send_get_req (const std::string & resp,
                   struct GDFSNode * node);
 
-    bool
-    send_generate_id_req (std::string & url);
+    responseStatus
+    send_generate_id_req (const std::string & resp);
 
-    bool
-    send_upload_req (std::string & url,
-                     std::string & query,
-                     std::string & headers);
+    responseStatus
+    send_upload_req (const std::string & resp);
 
 };
 
@@ -0,0 +1,457 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+#include <algorithm>
+
+#include <errno.h>
+#include <assert.h>
+
+#include "writeback.h"
+#include "gdapi.h"
+#include "log.h"
+#include "exception.h"
+
+
+time_t writeback_quiet_period = GDFS_WRITEBACK_QUIET_PERIOD;
+time_t writeback_max_staleness = GDFS_WRITEBACK_MAX_STALENESS;
+
+
+Writeback::Writeback (GDrive * gdi_) :
+  gdi(gdi_),
+  stop(false),
+  nthreads(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&work_cond, NULL);
+  pthread_cond_init(&done_cond, NULL);
+
+  for (int i = 0; i < GDFS_WRITEBACK_THREADS; ++i) {
+    if (pthread_create(&threads[nthreads], NULL, run, this) == 0) {
+      ++nthreads;
+    }
+  }
+}
+
+
+Writeback::~Writeback (void)
+{
+  this->drain();
+
+  pthread_mutex_lock(&lock);
+  this->stop = true;
+  pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&done_cond);
+  pthread_cond_destroy(&work_cond);
+  pthread_mutex_destroy(&lock);
+}
+
+
+void *
+Writeback::run (void * arg)
+{
+
+  Writeback * obj = (Writeback *) arg;
+  struct GDFSEntry * entry = NULL;
+  struct timespec ts;
+  time_t wake = 0;
+
+  while (1) {
+    pthread_mutex_lock(&obj->lock);
+    while ((entry = obj->next_due(wake)) == NULL) {
+      if (obj->stop && obj->queue.empty()) {
+        break;
+      }
+
+      // Sleep until the next file is due, or a file is queued.
+      if (wake == 0) {
+        pthread_cond_wait(&obj->work_cond, &obj->lock);
+      } else {
+        ts.tv_sec = wake;
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait(&obj->work_cond, &obj->lock, &ts);
+      }
+    }
+    if (entry == NULL) {
+      pthread_mutex_unlock(&obj->lock);
+      break;
+    }
+    obj->queue.remove(entry);
+    pthread_mutex_unlock(&obj->lock);
+
+    obj->upload(entry);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Function to find a queued file whose upload is due.
+ * If none, wake is set to the time the next one is due,
+ * or 0 if the queue is empty.
+ * Must be called with lock held.
+ */
+struct GDFSEntry *
+Writeback::next_due (time_t & wake)
+{
+
+  time_t now = time(NULL);
+  time_t due = 0;
+
+  wake = 0;
+  for (auto entry : this->queue) {
+    struct WritebackState & st = this->files[entry];
+    if (st.retry_at != 0) {
+      // Failed before, hold it back until its retry is due.
+      due = st.retry_at;
+    } else if (st.urgent || this->stop) {
+      return entry;
+    } else {
+      due = std::min(st.released + writeback_quiet_period,
+                     st.dirty_since + writeback_max_staleness);
+    }
+    if (due <= now) {
+      return entry;
+    }
+    if (wake == 0 || due < wake) {
+      wake = due;
+    }
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Function to upload a queued file.
+ * The file is uploaded from a snapshot of it in the cache,
+ * so that it can be written to while being uploaded.
+ */
+void
+Writeback::upload (struct GDFSEntry * entry)
+{
+
+  Debug("<-- Entering Writeback upload() -->");
+
+  int error = 0;
+  size_t size = 0;
+  struct GDFSNode * node = NULL;
+
+  pthread_mutex_lock(&lock);
+  struct WritebackState & st = this->files[entry];
+  st.queued = false;
+  st.uploading = true;
+  st.urgent = false;
+  st.dirty_since = 0;
+  st.retry_at = 0;
+  st.sent = 0;
+  node = st.node;
+  pthread_mutex_unlock(&lock);
+
+  // The writes from now on are left for the next upload.
+  size = this->gdi->cache.snapshot(entry->file_id, node);
+
+  pthread_mutex_lock(&lock);
+  st.total = size;
+  pthread_mutex_unlock(&lock);
+
+  try {
+    this->gdi->write_file(node, size, [this, entry] (uint64_t sent, uint64_t total) {
+      pthread_mutex_lock(&lock);
+      struct WritebackState & st = this->files[entry];
+      st.sent = sent;
+      st.total = total;
+      pthread_mutex_unlock(&lock);
+      Debug("write-back of %s: %llu of %llu bytes", entry->file_id.c_str(), sent, total);
+    });
+    this->gdi->cache.clean(entry->file_id);
+  } catch (GDFSException & err) {
+    Error("write-back of %s failed: %s", entry->file_id.c_str(), err.get().c_str());
+    this->gdi->cache.release(entry->file_id);
+    error = EIO;
+  }
+
+  pthread_mutex_lock(&lock);
+  st.uploading = false;
+  st.error = error;
+  if (error == 0) {
+    st.attempts = 0;
+  } else if (st.attempts < GDFS_WRITEBACK_MAX_RETRIES) {
+    // Try again later, backing off after every failure.
+    st.retry_at = time(NULL) + ((GDFS_RETRY_DELAY / 1000) << st.attempts);
+    ++st.attempts;
+    st.again = true;
+  } else {
+    // Keep the file dirty, so that the next release
+    // or fsync uploads it again.
+    Error("write-back of %s: giving up after %d attempts", entry->file_id.c_str(), st.attempts + 1);
+    st.attempts = 0;
+    entry->write = true;
+  }
+
+  // Released again while uploading.
+  if (st.again) {
+    st.again = false;
+    st.queued = true;
+    this->queue.emplace_back(entry);
+    pthread_cond_broadcast(&work_cond);
+  } else if (st.error == 0) {
+    this->files.erase(entry);
+  }
+  pthread_cond_broadcast(&done_cond);
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting Writeback upload() -->");
+}
+
+
+// Must be called with lock held.
+bool
+Writeback::is_pending (struct GDFSEntry * entry)
+{
+  auto it = this->files.find(entry);
+  return (it != this->files.end() &&
+          (it->second.queued || it->second.uploading));
+}
+
+
+/*
+ * Function to queue a file to be uploaded.
+ * Returns immediately. Unless urgent, the upload starts only after
+ * the quiet period, and every release of the file in the meantime
+ * is folded into the same upload.
+ */
+void
+Writeback::schedule (struct GDFSNode * node,
+                     bool urgent)
+{
+
+  Debug("<-- Entering Writeback schedule() -->");
+
+  assert(node != NULL);
+
+  time_t now = time(NULL);
+  struct GDFSEntry * entry = node->entry;
+
+  pthread_mutex_lock(&lock);
+  struct WritebackState & st = this->files[entry];
+  st.node = node;
+  st.error = 0;
+  st.attempts = 0;
+  st.retry_at = 0;
+  st.released = now;
+  if (st.dirty_since == 0) {
+    st.dirty_since = now;
+  }
+  if (urgent) {
+    st.urgent = true;
+  }
+
+  if (st.uploading) {
+    st.again = true;
+  } else if (st.queued == false) {
+    st.queued = true;
+    this->queue.emplace_back(entry);
+  } else {
+    Debug("write-back of %s coalesced", entry->file_id.c_str());
+  }
+  pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting Writeback schedule() -->");
+}
+
+
+/*
+ * Function to wait until the file has been uploaded.
+ * Returns 0 if the file is safe in Google Drive,
+ * or the error of its last upload.
+ */
+int
+Writeback::wait (struct GDFSEntry * entry)
+{
+
+  Debug("<-- Entering Writeback wait() -->");
+
+  int error = 0;
+
+  pthread_mutex_lock(&lock);
+  while (this->is_pending(entry)) {
+    // No more waiting for the quiet period.
+    struct WritebackState & st = this->files[entry];
+    if (st.queued && st.urgent == false) {
+      st.urgent = true;
+      pthread_cond_broadcast(&work_cond);
+    }
+    pthread_cond_wait(&done_cond, &lock);
+  }
+
+  // Report the error only once.
+  auto it = this->files.find(entry);
+  if (it != this->files.end()) {
+    error = it->second.error;
+    this->files.erase(it);
+  }
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting Writeback wait() -->");
+  return error;
+}
+
+
+/*
+ * Function to drop the write-back of a file which is being deleted.
+ * Waits for its upload in flight, if any.
+ */
+void
+Writeback::cancel (struct GDFSEntry * entry)
+{
+
+  Debug("<-- Entering Writeback cancel() -->");
+
+  pthread_mutex_lock(&lock);
+  auto it = this->files.find(entry);
+  if (it != this->files.end()) {
+    it->second.again = false;
+    if (it->second.queued) {
+      it->second.queued = false;
+      this->queue.remove(entry);
+    }
+    while (this->files[entry].uploading) {
+      pthread_cond_wait(&done_cond, &lock);
+    }
+    this->files.erase(entry);
+  }
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting Writeback cancel() -->");
+}
+
+
+/*
+ * Function to get the progress of the upload of a file.
+ * Returns false if the file is not waiting to be uploaded.
+ */
+bool
+Writeback::get_progress (struct GDFSEntry * entry,
+                         uint64_t & sent,
+                         uint64_t & total)
+{
+
+  bool ret = false;
+
+  pthread_mutex_lock(&lock);
+  auto it = this->files.find(entry);
+  if (it != this->files.end() &&
+      (it->second.queued || it->second.uploading)) {
+    sent  = it->second.sent;
+    total = it->second.total;
+    ret = true;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return ret;
+}
+
+
+/*
+ * Function to upload the queued files without waiting
+ * for their quiet period.
+ */
+void
+Writeback::hurry (void)
+{
+  pthread_mutex_lock(&lock);
+  for (auto entry : this->queue) {
+    this->files[entry].urgent = true;
+  }
+  pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * Function to wait until all the queued files have been uploaded.
+ * The failed uploads are retried first; the files whose upload
+ * still fails are reported, as their changes are about to be lost.
+ */
+void
+Writeback::drain (void)
+{
+
+  Debug("<-- Entering Writeback drain() -->");
+
+  pthread_mutex_lock(&lock);
+  for (auto & f : this->files) {
+    if (f.second.error != 0 &&
+        f.second.queued == false &&
+        f.second.uploading == false) {
+      f.second.error = 0;
+      f.second.queued = true;
+      this->queue.emplace_back(f.first);
+    }
+  }
+
+  while (this->queue.empty() == false ||
+         std::any_of(this->files.begin(), this->files.end(),
+                     [] (const std::pair <struct GDFSEntry * const, struct WritebackState> & f) {
+                       return f.second.uploading;
+                     })) {
+    // Upload everything now.
+    for (auto entry : this->queue) {
+      this->files[entry].urgent = true;
+    }
+    pthread_cond_broadcast(&work_cond);
+    pthread_cond_wait(&done_cond, &lock);
+  }
+
+  for (auto & f : this->files) {
+    if (f.second.error != 0) {
+      Error("write-back of %s failed, its changes are not in Google Drive",
+            f.first->file_id.c_str());
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  Debug("<-- Exiting Writeback drain() -->");
+}
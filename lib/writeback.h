@@ -0,0 +1,168 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+#ifndef WRITEBACK_H__
+#define WRITEBACK_H__
+
+
+#include <list>
+#include <unordered_map>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "dir_tree.h"
+#include "conf.h"
+
+
+/***********************************************/
+/*            WRITE-BACK SCHEDULER             */
+/*                                             */
+/***********************************************/
+
+
+// Write-back policy, in seconds.
+// A queued file is uploaded once it has not been released for the
+// quiet period, or once its oldest unsaved write is max staleness old.
+extern time_t writeback_quiet_period;
+extern time_t writeback_max_staleness;
+
+
+// Upload state of a file.
+// A file is queued on release, and uploaded by one of the
+// write-back threads. If it is released again while being uploaded,
+// it is queued again once the upload completes.
+// dirty_since is the time of the first release not yet uploaded,
+// and released the time of the last one. An urgent file is uploaded
+// without waiting for the quiet period.
+// A failed upload is queued again, not before retry_at, upto
+// GDFS_WRITEBACK_MAX_RETRIES times with the delay doubling each time.
+struct WritebackState {
+  struct GDFSNode * node;
+  bool queued;
+  bool uploading;
+  bool again;
+  bool urgent;
+  int error;
+  int attempts;
+  time_t dirty_since;
+  time_t released;
+  time_t retry_at;
+  uint64_t sent;
+  uint64_t total;
+
+  WritebackState (void) :
+    node(NULL),
+    queued(false),
+    uploading(false),
+    again(false),
+    urgent(false),
+    error(0),
+    attempts(0),
+    dirty_since(0),
+    released(0),
+    retry_at(0),
+    sent(0),
+    total(0) {};
+};
+
+
+class GDrive;
+
+/*
+ * Uploads the modified files to Google Drive in the background,
+ * so that closing a file never waits for its upload.
+ * Upto GDFS_WRITEBACK_THREADS files are uploaded at a time,
+ * and a file is never uploaded twice at the same time.
+ * The releases of a file that is opened and closed over and over
+ * are coalesced into a single upload of its final contents.
+ */
+class Writeback {
+  private:
+    GDrive * gdi;
+    bool stop;
+    int nthreads;
+    pthread_t threads[GDFS_WRITEBACK_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    std::list <struct GDFSEntry *> queue;
+    std::unordered_map <struct GDFSEntry *, struct WritebackState> files;
+
+    static void *
+    run (void * arg);
+
+    void
+    upload (struct GDFSEntry * entry);
+
+    bool
+    is_pending (struct GDFSEntry * entry);
+
+    struct GDFSEntry *
+    next_due (time_t & wake);
+
+  public:
+    Writeback (GDrive * gdi_);
+
+    ~Writeback (void);
+
+    void
+    schedule (struct GDFSNode * node,
+              bool urgent = false);
+
+    int
+    wait (struct GDFSEntry * entry);
+
+    void
+    cancel (struct GDFSEntry * entry);
+
+    bool
+    get_progress (struct GDFSEntry * entry,
+                  uint64_t & sent,
+                  uint64_t & total);
+
+    void
+    hurry (void);
+
+    void
+    drain (void);
+
+};
+
+
+#endif // WRITEBACK_H__
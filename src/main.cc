@@ -39,6 +39,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <pwd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -48,6 +49,9 @@
 #include "log.h"
 #include "main.h"
 #include "conf.h"
+#include "writeback.h"
+#include "disk_cache.h"
+#include "cache.h"
 #include "exception.h"
 
 
@@ -107,6 +111,38 @@ main (int argc,
         log_level = optarg;
         break;
 
+      case 'q':
+        writeback_quiet_period = atoi(optarg);
+        break;
+
+      case 'w':
+        writeback_max_staleness = atoi(optarg);
+        break;
+
+      case 'c':
+        disk_cache_dir = optarg;
+        break;
+
+      case 'z':
+        disk_cache_max_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+        break;
+
+      case 'p':
+        cache_policy = optarg;
+        break;
+
+      case 't':
+        cache_trace = optarg;
+        break;
+
+      case 'a':
+        cache_high_watermark = atoi(optarg);
+        break;
+
+      case 'b':
+        cache_low_watermark = atoi(optarg);
+        break;
+
       case 'o':
         len = strlen(optarg);
         for (int k = strlen(optarg) - 1; k >= 0; k--) {
@@ -59,8 +59,16 @@ static struct option long_opt[] = {
  {"log_level", required_argument, NULL, 'e'},
  {"mount_point", required_argument, NULL, 'm'},
  {"option", required_argument, NULL, 'o'},
+ {"writeback_quiet", required_argument, NULL, 'q'},
+ {"writeback_max_stale", required_argument, NULL, 'w'},
+ {"disk_cache_path", required_argument, NULL, 'c'},
+ {"disk_cache_size", required_argument, NULL, 'z'},
+ {"cache_policy", required_argument, NULL, 'p'},
+ {"cache_trace", required_argument, NULL, 't'},
+ {"cache_high_watermark", required_argument, NULL, 'a'},
+ {"cache_low_watermark", required_argument, NULL, 'b'},
 };
 
-const char * optstr = ":m:ho:vl:dfe:s";
+const char * optstr = ":m:ho:vl:dfe:sq:w:c:z:p:t:a:b:";
 
 #endif // MAIN_H__
@@ -0,0 +1,211 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+
+/*
+ * Measures the read throughput of the file cache as the number
+ * of threads reading from it grows from 1 to 32, the way the
+ * multithreaded FUSE loop calls into it from gdfs_read().
+ *
+ * The files are cached beforehand, so that every read is served
+ * from memory, and no request is sent to Google Drive.
+ * Every thread reads a random chunk of a random file at a time.
+ *
+ * Usage: cache_bench [seconds per run] [read size in KB]
+ */
+
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "conf.h"
+#include "cache.h"
+#include "dir_tree.h"
+#include "log.h"
+#include "common.h"
+
+
+#define BENCH_FILES 64
+#define BENCH_FILE_SIZE 1048576
+#define BENCH_MAX_THREADS 32
+
+
+struct Bench {
+  LRUCache * cache;
+  std::vector <struct GDFSNode *> nodes;
+  size_t chunk;
+  std::atomic <bool> start;
+  std::atomic <bool> stop;
+};
+
+
+struct Worker {
+  struct Bench * bench;
+  pthread_t thread;
+  unsigned seed;
+  uint64_t bytes;
+};
+
+
+static void *
+reader (void * arg)
+{
+
+  struct Worker * w = (struct Worker *) arg;
+  struct Bench * b = w->bench;
+  struct GDFSNode * node = NULL;
+  std::vector <char> buf(b->chunk);
+  off_t offset;
+
+  while (b->start == false) {
+    sched_yield();
+  }
+
+  while (b->stop == false) {
+    node = b->nodes[rand_r(&w->seed) % b->nodes.size()];
+    offset = (rand_r(&w->seed) % (BENCH_FILE_SIZE / b->chunk)) * b->chunk;
+    w->bytes += b->cache->get(node->entry->file_id, buf.data(), offset, b->chunk, node, true);
+  }
+
+  return NULL;
+}
+
+
+// Runs nthreads readers for the given time.
+// Returns the throughput in MB/s.
+static double
+run (struct Bench & b,
+     int nthreads,
+     unsigned seconds)
+{
+
+  std::vector <struct Worker> workers(nthreads);
+  uint64_t bytes = 0;
+  uint64_t begin_ms;
+  uint64_t elapsed;
+
+  b.start = false;
+  b.stop = false;
+  for (int i = 0; i < nthreads; ++i) {
+    workers[i].bench = &b;
+    workers[i].seed = i + 1;
+    workers[i].bytes = 0;
+    pthread_create(&workers[i].thread, NULL, reader, &workers[i]);
+  }
+
+  begin_ms = now_ms();
+  b.start = true;
+  sleep(seconds);
+  b.stop = true;
+
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    bytes += workers[i].bytes;
+  }
+  elapsed = now_ms() - begin_ms;
+
+  return (elapsed > 0) ? (bytes / 1048576.0) / (elapsed / 1000.0) : 0;
+}
+
+
+int
+main (int argc,
+      char ** argv)
+{
+
+  unsigned seconds = 2;
+  double mbps;
+  double base = 0;
+  struct Bench b;
+  std::vector <char> buf(BENCH_FILE_SIZE);
+
+  if (argc > 1) {
+    seconds = strtoul(argv[1], NULL, 10);
+  }
+  b.chunk = 128 * 1024;
+  if (argc > 2) {
+    b.chunk = strtoul(argv[2], NULL, 10) * 1024;
+  }
+  if (seconds == 0 || b.chunk == 0 || b.chunk > BENCH_FILE_SIZE) {
+    fprintf(stderr, "Usage: %s [seconds per run] [read size in KB, upto %d]\n",
+            argv[0], BENCH_FILE_SIZE / 1024);
+    return 1;
+  }
+
+  logging_::init_logging("/dev/null", "ERROR", false, false);
+
+  // No disk cache, and files not in Google Drive yet,
+  // so that the cache never leaves memory.
+  disk_cache_max_size = 0;
+  Auth auth("");
+  b.cache = new LRUCache(auth, "");
+
+  for (int i = 0; i < BENCH_FILES; ++i) {
+    struct GDFSEntry * entry = new GDFSEntry("bench" + std::to_string(i), BENCH_FILE_SIZE, false,
+                                             time(NULL), time(NULL), 0, 0, GDFS_DEF_FILE_MODE);
+    entry->pending_create = true;
+    b.nodes.emplace_back(new GDFSNode(entry->file_id, entry, NULL));
+    b.cache->get(entry->file_id, buf.data(), 0, BENCH_FILE_SIZE, b.nodes.back());
+  }
+
+  printf("%d files of %d KB in cache, reads of %zu KB, %u s per run\n",
+         BENCH_FILES, BENCH_FILE_SIZE / 1024, b.chunk / 1024, seconds);
+  printf("%8s %12s %8s\n", "threads", "MB/s", "speedup");
+  for (int n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+    mbps = run(b, n, seconds);
+    if (n == 1) {
+      base = mbps;
+    }
+    printf("%8d %12.1f %8.2f\n", n, mbps, (base > 0) ? mbps / base : 0);
+  }
+
+  delete b.cache;
+  for (auto node : b.nodes) {
+    delete node;
+  }
+  logging_::stop_logging();
+
+  return 0;
+}
@@ -0,0 +1,179 @@
+
+/*
+ * Copyright (c) 2016, Robin Thomas.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * The name of Robin Thomas or any other contributors to this software
+ * should not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * Author: Robin Thomas <robinthomas2591@gmail.com>
+ *
+ */
+
+
+
+/*
+ * Replays a trace of the file cache against every eviction policy,
+ * and reports their hit ratio and byte hit ratio.
+ *
+ * The trace is recorded by mounting GDFS with --cache_trace <file>.
+ * Every line of it is an access: <file id> <offset> <length>
+ *
+ * Usage: cache_replay <trace file> [cache size in MB]
+ */
+
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "conf.h"
+#include "cache_policy.h"
+
+
+struct Access {
+  std::string file_id;
+  uint64_t offset;
+  uint64_t len;
+};
+
+
+struct Result {
+  uint64_t requests;
+  uint64_t hits;
+  uint64_t bytes;
+  uint64_t hit_bytes;
+};
+
+
+// Simulates the cache at the block level, evicting whole files
+// the way LRUCache does, until the cache fits in capacity.
+static struct Result
+replay (const std::vector <struct Access> & trace,
+        CachePolicy * policy,
+        uint64_t capacity)
+{
+
+  struct Result result = Result();
+  uint64_t used = 0;
+  std::string victim;
+  std::unordered_map <std::string, std::unordered_set <uint64_t>> resident;
+  std::unordered_map <std::string, uint64_t> last_end;
+
+  for (auto & a : trace) {
+    bool hit = true;
+    bool counted = true;
+
+    auto it = last_end.find(a.file_id);
+    if (it != last_end.end() && it->second == a.offset) {
+      counted = false;
+    }
+    last_end[a.file_id] = a.offset + a.len;
+
+    std::unordered_set <uint64_t> & blocks = resident[a.file_id];
+    for (uint64_t b = a.offset / GDFS_CACHE_BLOCK_SIZE;
+         b <= (a.offset + a.len - 1) / GDFS_CACHE_BLOCK_SIZE;
+         ++b) {
+      uint64_t start = std::max(a.offset, b * GDFS_CACHE_BLOCK_SIZE);
+      uint64_t stop = std::min(a.offset + a.len, (b + 1) * GDFS_CACHE_BLOCK_SIZE);
+
+      if (blocks.count(b) > 0) {
+        result.hit_bytes += stop - start;
+      } else {
+        hit = false;
+        blocks.insert(b);
+        used += GDFS_CACHE_BLOCK_SIZE;
+      }
+    }
+
+    ++result.requests;
+    result.bytes += a.len;
+    if (hit) {
+      ++result.hits;
+    }
+
+    policy->access(a.file_id, counted);
+    while (used > capacity && policy->evict(victim)) {
+      used -= resident[victim].size() * GDFS_CACHE_BLOCK_SIZE;
+      resident.erase(victim);
+    }
+  }
+
+  return result;
+}
+
+
+int
+main (int argc,
+      char ** argv)
+{
+
+  FILE * fp = NULL;
+  char file_id[256];
+  long long offset;
+  unsigned long long len;
+  uint64_t capacity = GDFS_CACHE_MAX_SIZE;
+  std::vector <struct Access> trace;
+  const char * policies[] = { "lru", "tinylfu" };
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <trace file> [cache size in MB]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2) {
+    capacity = strtoull(argv[2], NULL, 10) * 1024 * 1024;
+  }
+
+  fp = fopen(argv[1], "r");
+  if (fp == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  while (fscanf(fp, "%255s %lld %llu", file_id, &offset, &len) == 3) {
+    if (len > 0 && offset >= 0) {
+      trace.push_back({ file_id, (uint64_t) offset, len });
+    }
+  }
+  fclose(fp);
+
+  printf("%zu accesses, cache of %llu MB\n", trace.size(), (unsigned long long) (capacity >> 20));
+  for (auto name : policies) {
+    CachePolicy * policy = CachePolicy::create(name);
+    struct Result r = replay(trace, policy, capacity);
+    printf("%-8s hit ratio %6.2f%%, byte hit ratio %6.2f%%\n", policy->name(),
+           r.requests ? 100.0 * r.hits / r.requests : 0.0,
+           r.bytes ? 100.0 * r.hit_bytes / r.bytes : 0.0);
+    delete policy;
+  }
+
+  return 0;
+}